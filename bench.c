@@ -0,0 +1,307 @@
+/*
+ * PFN database layout microbenchmark.
+ *
+ * Compares the hot/cold split PFN database against the former single-array
+ * layout (seven packed words per page, pointer queue links) for the two access
+ * patterns that dominate: a linear scan of every entry, as done by
+ * vm_dump_page_summary(), and a walk along a page queue in physically random
+ * order, as done by steal_page() on the standby queue.
+ *
+ * Also times each set of page kernels (see pageops.c) against libc's memset()
+ * and memcpy() on 4 KiB pages.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <linux/perf_event.h>
+#include <kdk/vm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm/vmp.h"
+
+/*! The PFN database entry as it was before the hot/cold split. */
+struct legacy_page {
+	struct __attribute__((packed)) {
+		uint64_t pfn : 52;
+		enum vm_page_use use : 4;
+		bool dirty : 1;
+		bool busy : 1;
+		uintptr_t order : 5;
+		bool on_freelist : 1;
+	};
+	uint32_t ptes;
+	uint16_t refcnt;
+	paddr_t referent_pte;
+	struct legacy_page *next, *prev;
+	void *process;
+	uintptr_t drumslot;
+};
+
+struct bench_result {
+	double ns_per_page;
+	long long misses;
+};
+
+static int
+perf_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+bench_start(int fd, uint64_t *start)
+{
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	*start = now_ns();
+}
+
+static void
+bench_stop(int fd, uint64_t start, size_t npages, struct bench_result *res)
+{
+	uint64_t end = now_ns();
+
+	res->ns_per_page = (double)(end - start) / npages;
+	res->misses = -1;
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &res->misses, sizeof(res->misses)) !=
+		    sizeof(res->misses))
+			res->misses = -1;
+	}
+}
+
+static void
+report(const char *what, struct bench_result *old, struct bench_result *new)
+{
+	printf("%-14s %10.2f %10.2f", what, old->ns_per_page,
+	    new->ns_per_page);
+	if (old->misses >= 0 && new->misses >= 0)
+		printf(" %12lld %12lld\n", old->misses, new->misses);
+	else
+		printf(" %12s %12s\n", "n/a", "n/a");
+}
+
+/*!
+ * Run the PFN database microbenchmark over a synthetic database of \p npages
+ * entries and print the results. The real PFN database is left alone.
+ */
+void
+SIM_pfndb_bench(size_t npages)
+{
+	struct legacy_page *old;
+	vm_page_t *hot;
+	uint32_t *order;
+	struct bench_result old_res, new_res;
+	volatile size_t sink = 0;
+	size_t count;
+	uint64_t start;
+	int fd;
+
+	kassert(npages > 0 && npages < VMP_PGQ_NONE);
+
+	old = aligned_alloc(64, sizeof(*old) * npages);
+	hot = aligned_alloc(64, sizeof(*hot) * npages);
+	order = malloc(sizeof(*order) * npages);
+	if (old == NULL || hot == NULL || order == NULL)
+		kfatal("Out of memory for benchmark\n");
+
+	memset(old, 0, sizeof(*old) * npages);
+	memset(hot, 0, sizeof(*hot) * npages);
+	for (size_t i = 0; i < npages; i++) {
+		old[i].pfn = hot[i].pfn = i;
+		old[i].use = hot[i].use = i % 3 ? kPageUseAnonPrivate :
+						  kPageUseFree;
+		old[i].refcnt = hot[i].refcnt = i % 3 == 1;
+		order[i] = i;
+	}
+
+	/* standby pages are queued in no particular physical order */
+	srand(1);
+	for (size_t i = npages - 1; i > 0; i--) {
+		size_t j = rand() % (i + 1);
+		uint32_t tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for (size_t i = 0; i < npages; i++) {
+		uint32_t pfn = order[i];
+		uint32_t next = i + 1 < npages ? order[i + 1] : VMP_PGQ_NONE;
+		uint32_t prev = i > 0 ? order[i - 1] : VMP_PGQ_NONE;
+
+		hot[pfn].queue_next = next;
+		hot[pfn].queue_prev = prev;
+		old[pfn].next = next == VMP_PGQ_NONE ? NULL : &old[next];
+		old[pfn].prev = prev == VMP_PGQ_NONE ? NULL : &old[prev];
+	}
+
+	fd = perf_open();
+
+	printf("PFN database benchmark: %zu pages, entry %zu bytes "
+	       "(was %zu)\n",
+	    npages, sizeof(vm_page_t), sizeof(struct legacy_page));
+	printf("%-14s %10s %10s %12s %12s\n", "", "old ns/pg", "new ns/pg",
+	    "old misses", "new misses");
+
+	/* vm_dump_page_summary() */
+	count = 0;
+	bench_start(fd, &start);
+	for (size_t i = 0; i < npages; i++)
+		count += old[i].use != kPageUseFree && old[i].refcnt == 0;
+	bench_stop(fd, start, npages, &old_res);
+	sink += count;
+
+	count = 0;
+	bench_start(fd, &start);
+	for (size_t i = 0; i < npages; i++)
+		count += hot[i].use != kPageUseFree && hot[i].refcnt == 0;
+	bench_stop(fd, start, npages, &new_res);
+	sink += count;
+	report("summary scan", &old_res, &new_res);
+
+	/* steal_page() walking the standby queue */
+	count = 0;
+	bench_start(fd, &start);
+	for (struct legacy_page *page = &old[order[0]]; page != NULL;
+	     page = page->next)
+		count += page->use == kPageUseAnonPrivate && page->refcnt == 0;
+	bench_stop(fd, start, npages, &old_res);
+	sink += count;
+
+	count = 0;
+	bench_start(fd, &start);
+	for (uint32_t pfn = order[0]; pfn != VMP_PGQ_NONE;
+	     pfn = hot[pfn].queue_next)
+		count += hot[pfn].use == kPageUseAnonPrivate &&
+		    hot[pfn].refcnt == 0;
+	bench_stop(fd, start, npages, &new_res);
+	sink += count;
+	report("standby walk", &old_res, &new_res);
+
+	if (fd < 0)
+		printf("(cache miss counts unavailable: perf_event_open "
+		       "failed)\n");
+	else
+		close(fd);
+
+	(void)sink;
+	free(order);
+	free(hot);
+	free(old);
+}
+
+/*! Pages the page kernels are timed over: 16 MiB, to go past most caches. */
+#define KERNEL_BENCH_PAGES 4096
+/*! Passes over them. */
+#define KERNEL_BENCH_PASSES 8
+
+enum kernel_op { kOpZero, kOpZeroNT, kOpCopy, kOpCopyNT, kOpIsZero, kNOps };
+
+static double
+kernel_time(const struct vmp_page_kernels *k, enum kernel_op op, char *dst,
+    const char *src)
+{
+	volatile bool sink = false;
+	uint64_t start = now_ns();
+
+	for (size_t pass = 0; pass < KERNEL_BENCH_PASSES; pass++) {
+		for (size_t i = 0; i < KERNEL_BENCH_PAGES; i++) {
+			char *to = dst + i * PGSIZE;
+			const char *from = src + i * PGSIZE;
+
+			switch (op) {
+			case kOpZero:
+				k->zero(to);
+				break;
+			case kOpZeroNT:
+				k->zero_nt(to);
+				break;
+			case kOpCopy:
+				k->copy(to, from);
+				break;
+			case kOpCopyNT:
+				k->copy_nt(to, from);
+				break;
+			case kOpIsZero:
+				sink |= k->is_zero(to);
+				break;
+			default:
+				kfatal("Bad kernel op %d\n", op);
+			}
+		}
+	}
+
+	(void)sink;
+	return (double)(now_ns() - start) /
+	    (KERNEL_BENCH_PASSES * KERNEL_BENCH_PAGES);
+}
+
+/*!
+ * Time each set of page kernels the CPU supports and print ns per page. The
+ * "libc" set is memset() and memcpy() alone, so has no non-temporal forms,
+ * which are shown as n/a.
+ */
+void
+SIM_page_kernels_bench(void)
+{
+	size_t size = (size_t)KERNEL_BENCH_PAGES * PGSIZE;
+	char *src, *dst;
+
+	src = aligned_alloc(PGSIZE, size);
+	dst = aligned_alloc(PGSIZE, size);
+	if (src == NULL || dst == NULL)
+		kfatal("Out of memory for benchmark\n");
+
+	for (size_t i = 0; i < size; i++)
+		src[i] = (char)i;
+	/* fault the destination in, so the first kernel timed isn't charged */
+	memset(dst, 0, size);
+
+	vmp_page_kernels_init();
+	printf("%-14s %10s %10s %10s %10s %10s\n", "ns/page", "zero",
+	    "zero-nt", "copy", "copy-nt", "is-zero");
+	for (size_t i = 0; i < vmp_npage_kernels; i++) {
+		const struct vmp_page_kernels *k = &vmp_page_kernels[i];
+
+		if (!k->supported())
+			continue;
+
+		printf("%-14s", k->name);
+		for (enum kernel_op op = 0; op < kNOps; op++) {
+			if ((op == kOpZeroNT && k->zero_nt == NULL) ||
+			    (op == kOpCopyNT && k->copy_nt == NULL))
+				printf(" %10s", "n/a");
+			else
+				printf(" %10.2f", kernel_time(k, op, dst, src));
+		}
+		printf("\n");
+	}
+
+	free(dst);
+	free(src);
+}
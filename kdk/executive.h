@@ -12,6 +12,14 @@ typedef struct eprocess {
 	kmutex_t vad_lock;
 	struct vm_vad_rbtree vad_tree;
 	kmutex_t ws_lock;
+	/*!
+	 * Guards the working set list itself. The WS lock is needed to change
+	 * the process' PTEs; this one only covers the list, since page stealing
+	 * updates it without the WS lock.
+	 */
+	kspinlock_t wsl_lock;
+	/*! Standby priority given to pages trimmed from this process. */
+	unsigned page_priority;
 	void *pml4;
 	struct vm_page *pml4_page;
 	struct {
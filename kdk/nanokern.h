@@ -32,6 +32,12 @@ splget()
 #define KSPINLOCK_INITIALISER PTHREAD_MUTEX_INITIALIZER
 typedef pthread_mutex_t kspinlock_t;
 
+static inline void
+ke_spinlock_init(kspinlock_t *lock)
+{
+	pthread_mutex_init(lock, NULL);
+}
+
 static inline ipl_t
 ke_spinlock_acquire(kspinlock_t *lock)
 {
@@ -1,6 +1,7 @@
 #ifndef KRX_KDK_PLATFORM_H
 #define KRX_KDK_PLATFORM_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define KRX_PLATFORM_BITS 64
@@ -11,8 +12,29 @@
 
 #define vm_page_direct_map_addr(PAGE) P2V(vmp_page_paddr(PAGE))
 
-#define SOFT_NPAGES 32
+/*! Default size of the simulated physical arena, in pages. */
+#define SOFT_DEFAULT_NPAGES 32
 
-extern uint8_t SOFT_pages[4096 * SOFT_NPAGES];
+/*! Simulated physical memory; allocated at startup by SIM_pages_init(). */
+extern uint8_t *SOFT_pages;
+/*! Number of pages in the simulated physical arena. */
+extern size_t SOFT_npages;
+/*! Host pages backing the simulated physical arena. */
+enum soft_arena_backing {
+	/*! Ordinary host pages. */
+	kSoftArenaSmall,
+	/*! Transparent huge pages, asked for with madvise(). */
+	kSoftArenaTHP,
+	/*! Huge pages from the host's reserved pool (MAP_HUGETLB). */
+	kSoftArenaHugeTLB,
+};
+
+/*!
+ * Backing wanted for the simulated physical arena and the PFN database; set
+ * before SIM_pages_init(), which falls back to smaller pages as needed.
+ */
+extern enum soft_arena_backing SIM_arena_backing;
+/*! NUMA node of the simulated CPU the current thread is running on. */
+extern __thread unsigned SIM_node;
 
 #endif /* KRX_KDK_PLATFORM_H */
@@ -4,15 +4,10 @@
 #include <kdk/defs.h>
 #include <kdk/queue.h>
 #include <kdk/soft.h>
+#include <stddef.h>
 
 #pragma GCC diagnostic ignored "-Waddress-of-packed-member"
 
-#if KRX_PLATFORM_BITS == 32
-#define PFN_BITS 20
-#else
-#define PFN_BITS 52
-#endif
-
 enum vm_page_use {
 	/*! Invalid sentinel value. */
 	kPageUseInvalid,
@@ -24,6 +19,8 @@ enum vm_page_use {
 	kPageUseDeleted,
 	/*! Page is used by kernel wired memory. */
 	kPageUseKWired,
+	/*! Page is held by the memory balloon. */
+	kPageUseBalloon,
 	/*! Page belongs to process-private anonymous memory. */
 	kPageUseAnonPrivate,
 	/*! Page belongs to a shared anonymous section. */
@@ -45,19 +42,48 @@ enum vm_page_use {
 /*!
  * PFN database element. Mainly for private use by the VMM, but published here
  * publicly for efficiency.
+ *
+ * This holds only the fields that queue manipulation, faults and scans of the
+ * PFN database touch all the time, so that four fit to a cache line; the rest
+ * live in the parallel vm_page_cold_t array.
  */
-typedef struct vm_page {
+typedef struct __attribute__((aligned(16))) vm_page {
 	/* first word */
-	struct __attribute__((packed)) {
-		pfn_t pfn : PFN_BITS;
-		enum vm_page_use use : 4;
-		bool dirty : 1;
-		bool busy : 1;
-		uintptr_t order : 5;
-		bool on_freelist : 1;
-	};
+	uint32_t pfn;
+	/* these are guarded by the page lock */
+	enum vm_page_use use : 4;
+	bool dirty : 1;
+	/*! Which standby list the page goes on; set when it is trimmed. */
+	unsigned standby_priority : 3;
+	/*
+	 * these are guarded by the node's free lock, and kept in a byte of
+	 * their own: a page's are read as its buddy's while others may be
+	 * writing the fields above.
+	 */
+	uint8_t : 0;
+	unsigned order : 5;
+	bool on_freelist : 1;
+	/*!
+	 * Reference count in the low 15 bits, page lock in the top bit. Atomic
+	 * so that pages already active can be retained and released without
+	 * locking; see vmp_page_retain(). Read with vmp_page_refcnt().
+	 */
+	_Atomic uint16_t refcnt;
 
 	/* second word */
+	/*! Standby/modified/free queue links, as PFNs. */
+	uint32_t queue_next, queue_prev;
+} vm_page_t;
+
+_Static_assert(sizeof(vm_page_t) == 16, "vm_page_t should be 16 bytes");
+_Static_assert(offsetof(vm_page_t, refcnt) == 6,
+    "vm_page_t's flags should take two bytes");
+
+/*!
+ * PFN database element, seldom-used part. Found with vmp_page_cold().
+ */
+typedef struct vm_page_cold {
+	/* first word */
 	union __attribute__((packed)) {
 		/* kPageUsePML* */
 		struct __attribute__((packed)) {
@@ -69,20 +95,15 @@ typedef struct vm_page {
 		/* kPageUse*Shared: offset into section */
 		uint64_t offset : 48;
 	};
-	uint16_t refcnt;
 
-	/* third word */
+	/* second word */
 	paddr_t referent_pte;
 
-	/* 4th, 5th words */
-	union __attribute__((packed)) {
-		/*! Standby/modified/free queue link. */
-		TAILQ_ENTRY(vm_page) queue_link;
-		/*! If busy, the pager request. */
-		struct vmp_pager_state *pager_state;
-	};
+	/* third word */
+	/*! If busy, the pager request. */
+	struct vmp_pager_state *pager_state;
 
-	/* 6th word */
+	/* 4th word */
 	union __attribute__((packed)) {
 		/*! kPageUsePML* or kPageUseAnonPrivate */
 		struct eprocess *process;
@@ -92,9 +113,13 @@ typedef struct vm_page {
 		struct vmp_forkpage *forkpage;
 	};
 
-	/* 7th word */
+	/* 5th word */
 	uintptr_t drumslot;
-} vm_page_t;
+
+	/* 6th word */
+	/*! Faulted back in since it was last trimmed; guarded by the page lock. */
+	bool reused;
+} vm_page_cold_t;
 
 /*!
  * Memory descriptor list.
@@ -105,6 +130,16 @@ typedef struct vm_mdl {
 	vm_page_t *pages[0];
 } vm_mdl_t;
 
+/*! NUMA placement policy for the pages of a mapping. */
+enum vm_numa_policy {
+	/*! Allocate from the node of the CPU first touching the page. */
+	kNUMAPolicyFirstTouch,
+	/*! Allocate from a given node, falling back on others. */
+	kNUMAPolicyPreferred,
+	/*! Spread pages across the nodes of the faulting CPU's tier by page. */
+	kNUMAPolicyInterleave,
+};
+
 enum vmp_pte_kind {
 	kPTEKindZero,
 	kPTEKindTrans,
@@ -113,9 +148,101 @@ enum vmp_pte_kind {
 	kPTEKindValid,
 };
 
+/*!
+ * Number of standby lists. Clean inactive pages go on the list given by their
+ * standby_priority, which is set when they are trimmed, and pages are stolen
+ * from the lowest priority list first.
+ */
+#define VMP_STANDBY_PRIORITIES 8
+
+/*!
+ * VMM statistics, as returned by vm_stat_snapshot(). The page counts are of
+ * pages in each state or use at the time; the rest count events since boot.
+ */
+struct vm_stat {
+	size_t nfree, nzeroed, nmodified, nstandby, nactive;
+	size_t ntotal;
+	/*! Standby pages by priority; these sum to nstandby. */
+	size_t nstandby_prio[VMP_STANDBY_PRIORITIES];
+	/*! Standby pages stolen for reuse, by priority. */
+	size_t nrepurposed[VMP_STANDBY_PRIORITIES];
+	/*! Pages by use. */
+	size_t nuse[kPageUsePML4 + 1];
+	/*! Page faults, by kind of PTE found. */
+	size_t nfault[kPTEKindValid + 1];
+	/*! Pages written to the pagefile. */
+	size_t npageout;
+	/*! Pages found all zeroes when cleaned, and dropped instead. */
+	size_t npageout_zero;
+	/*! Reads of memory never written, mapped to the shared zero page. */
+	size_t nzero_page_mapped;
+	/*! Page tables trimmed from working sets, and made valid again. */
+	size_t ntable_evicted, ntable_reused;
+	/*! Evicted page tables stolen after writing out, and read back in. */
+	size_t ntable_paged_out, ntable_paged_in;
+	/*! Large pages mapped, and count split back into small pages. */
+	size_t nlarge, nlarge_split;
+	/*! Compaction runs, pages migrated by them, and time they took. */
+	size_t ncompact_runs, ncompact_moved, compact_ns;
+	/*! Pages moved into this node from the slow tier, or from the fast. */
+	size_t npromoted, ndemoted;
+	/*! Pages scanned for merging, mappings merged, and merges broken. */
+	size_t nmerge_scanned, nmerged, nunmerged;
+	/*!
+	 * Pages put in the compressed store, loaded from it, written back from
+	 * it to the pagefile, and turned away as compressing too poorly.
+	 */
+	size_t ncstore_stored, ncstore_loaded, ncstore_written, ncstore_rejected;
+	/*! Pages held in the compressed store, and their compressed bytes. */
+	size_t cstore_pages, cstore_bytes;
+	/*!
+	 * Pages taken by the balloon and given back, and balancer passes that
+	 * found none to take although short of the target.
+	 */
+	size_t nballoon_inflated, nballoon_deflated, nballoon_stalls;
+};
+
 int vm_fault(vaddr_t vaddr, bool write, vm_mdl_t *out);
 void vm_mdl_alloc(vm_mdl_t **out, size_t max_pages);
 void vm_mdl_release_pages(vm_mdl_t *mdl);
+/*!
+ * @brief Release the pages of several MDLs at once. This is cheaper than
+ * releasing each in turn: pages going inactive are queued in batches.
+ */
+void vm_mdl_release_pages_n(vm_mdl_t **mdls, size_t nmdls);
+
+/*!
+ * @brief Get a consistent snapshot of the statistics of node \p nodeid, or of
+ * all nodes if it is -1.
+ *
+ * This takes no locks and doesn't disturb the updaters, so it may be called as
+ * often as wanted; it only retries if a counter was folded while it ran.
+ */
+void vm_stat_snapshot(struct vm_stat *out, int nodeid);
+
+/*!
+ * @brief Set how fast identical anonymous pages are looked for: \p npages
+ * pages every \p interval_ns nanoseconds. No pages stops the scan.
+ */
+void vm_merge_set_rate(size_t npages, int64_t interval_ns);
+
+/*!
+ * @brief Set the number of pages the memory balloon should hold. Pages above
+ * the target are given back at once; the balancer takes more, as they can be
+ * had, until the balloon holds \p npages.
+ */
+void vm_balloon_set_target(size_t npages);
+/*! @brief Get the number of pages the memory balloon should hold. */
+size_t vm_balloon_target(void);
+
+/*!
+ * @brief Add \p size bytes of physical memory at \p base, which must start a
+ * section and lie within the physical address space, to NUMA node \p nodeid.
+ * Its pages are given to the node's free queues straight away.
+ *
+ * @returns 0, or -1 if the range is unsuitable or memory is already there.
+ */
+int vm_page_hot_add(paddr_t base, size_t size, unsigned nodeid);
 
 void vm_dump_pages(void);
 void vm_dump_page_summary(void);
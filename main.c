@@ -1,12 +1,60 @@
+#include <kdk/libkern.h>
 #include <kdk/nanokern.h>
 #include <kdk/vm.h>
+#include <time.h>
 
 #include "executive.h"
 #include "vm/vmp.h"
 
 __thread ipl_t SIM_ipl = kIPL0;
-pthread_t pgwriter_thread, balancer_thread;
+__thread unsigned SIM_node = 0;
+pthread_t pgwriter_thread, balancer_thread, zeroer_thread, compactor_thread,
+    tier_thread, merger_thread;
 eprocess_t kernel_ps;
+/*! Latency an access to slow tier memory adds, in nanoseconds. */
+unsigned SIM_slow_latency_ns = 250;
+
+/*!
+ * Set the accessed bit of a leaf PTE as the MMU does, from \p old, what the
+ * walk found in it. Fails if the PTE has changed since, or isn't valid.
+ */
+static bool
+mmu_set_accessed(pte_t *pte, pte_t old)
+{
+	pte_t new = old;
+
+	if (!old.hw.valid)
+		return false;
+	else if (old.hw.accessed)
+		return true;
+
+	new.hw.accessed = 1;
+	return __atomic_compare_exchange_n(&pte->u64, &old.u64, new.u64, false,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/*! Count an access to \p paddr, stalling for it if it is slow memory. */
+static void
+mmu_charge(paddr_t paddr)
+{
+	struct vmp_node *node = vmp_page_node(vmp_paddr_to_page(paddr));
+	struct timespec start, now;
+	uint64_t elapsed;
+
+	node->naccess_target++;
+
+	if (node->tier != kVMPTierSlow || SIM_slow_latency_ns == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * (uint64_t)NS_PER_S +
+		    now.tv_nsec - start.tv_nsec;
+	} while (elapsed < SIM_slow_latency_ns);
+
+	node->access_cost_ns += elapsed;
+}
 
 void
 access(paddr_t addr, bool for_write)
@@ -40,6 +88,20 @@ retry:
 		goto retry;
 	}
 
+	if (vmp_pte_hw_is_large(&l2[unpacked.pml2i])) {
+		pte = &l2[unpacked.pml2i];
+		if (for_write && !pte->hw.writeable) {
+			printf("mmu: write protected\n");
+			vm_fault(addr, for_write, NULL);
+			goto retry;
+		}
+		if (!mmu_set_accessed(pte, *pte))
+			goto retry;
+		final_addr = vmp_pte_hw_paddr(pte, 2) +
+		    unpacked.pml1i * PGSIZE;
+		goto translated;
+	}
+
 	l1 = (pte_t *)P2V(vmp_pte_hw_paddr(&l2[unpacked.pml2i], 2));
 	if (!l1[unpacked.pml1i].hw.valid) {
 		printf("mmu: invalid entry in pml1\n");
@@ -51,44 +113,196 @@ retry:
 		goto retry;
 	}
 
-	final_addr = vmp_pte_hw_paddr(&l1[unpacked.pml1i], 1);
+	pte = &l1[unpacked.pml1i];
+	if (!mmu_set_accessed(pte, *pte))
+		goto retry;
+	final_addr = vmp_pte_hw_paddr(pte, 1);
+
+translated:
+	mmu_charge(final_addr);
+	if (vmp_page_node(vmp_paddr_to_page(final_addr))->id == SIM_node)
+		vmp_nodes[SIM_node].naccess_local++;
+	else
+		vmp_nodes[SIM_node].naccess_remote++;
 
 	printf("mmu: %s 0x%zx => 0x%zx\n", for_write ? "write" : "read ", addr,
 	    final_addr + unpacked.pgi);
 }
 
+/*!
+ * Parse a memory size such as "64M" or "16G" into a byte count. A bare number
+ * is taken to be a count of bytes.
+ */
+static size_t
+parse_size(const char *str)
+{
+	char *end;
+	size_t size = strtoull(str, &end, 0);
+
+	switch (*end) {
+	case 'g':
+	case 'G':
+		size *= 1024;
+		/* fallthrough */
+	case 'm':
+	case 'M':
+		size *= 1024;
+		/* fallthrough */
+	case 'k':
+	case 'K':
+		size *= 1024;
+		break;
+
+	case '\0':
+		break;
+
+	default:
+		kfatal("Bad size \"%s\"\n", str);
+	}
+
+	return size;
+}
+
+static void
+usage(const char *prog)
+{
+	kfatal("Usage: %s [-m physical-memory-size] "
+	       "[-c compressed-store-size] [-A hot-add-size] "
+	       "[-B balloon-size] "
+	       "[-n numa-nodes] "
+	       "[-t slow-tier-nodes] "
+	       "[-l slow-tier-latency-ns] "
+	       "[-p first-touch|interleave|preferred-node] "
+	       "[-H small|thp|hugetlb] [-b]\n",
+	    prog);
+}
+
 int
-main(int argc, char *arv[])
+main(int argc, char *argv[])
 {
-	void SIM_pages_init(void);
+	size_t npages = SOFT_DEFAULT_NPAGES, cstore_npages = 0;
+	size_t hotadd_npages = 0, balloon_npages = 0;
+	pfn_t hotadd_base;
+	unsigned nnodes = 1, nslow = 0, policy_node = 0;
+	bool bench = false;
+	enum vm_numa_policy policy = kNUMAPolicyFirstTouch;
+
+	void SIM_pages_init(size_t npages, size_t maxpages, unsigned nnodes,
+	    unsigned nslow);
 	void SIM_paging_init(void);
+	void SIM_pfndb_bench(size_t npages);
+	void SIM_page_kernels_bench(void);
 	void vm_dump_pages(void);
 	void vmp_wsl_dump(eprocess_t * ps);
-	void *vmp_pgwriter(void *), *vmp_balancer(void *);
+	void *vmp_pgwriter(void *), *vmp_balancer(void *), *vmp_zeroer(void *);
+	void *vmp_compactor(void *), *vmp_tier_migrator(void *);
+	void *vmp_merger(void *);
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			npages = parse_size(argv[++i]) / PGSIZE;
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			cstore_npages = parse_size(argv[++i]) / PGSIZE;
+		else if (strcmp(argv[i], "-A") == 0 && i + 1 < argc)
+			hotadd_npages = parse_size(argv[++i]) / PGSIZE;
+		else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc)
+			balloon_npages = parse_size(argv[++i]) / PGSIZE;
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			nnodes = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			nslow = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+			SIM_slow_latency_ns = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "-b") == 0)
+			bench = true;
+		else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "hugetlb") == 0)
+				SIM_arena_backing = kSoftArenaHugeTLB;
+			else if (strcmp(argv[i], "thp") == 0)
+				SIM_arena_backing = kSoftArenaTHP;
+			else if (strcmp(argv[i], "small") == 0)
+				SIM_arena_backing = kSoftArenaSmall;
+			else
+				usage(argv[0]);
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "interleave") == 0)
+				policy = kNUMAPolicyInterleave;
+			else if (strcmp(argv[i], "first-touch") == 0)
+				policy = kNUMAPolicyFirstTouch;
+			else {
+				char *end;
 
-	SIM_pages_init();
+				/* only a node number, not a mistyped policy */
+				if (argv[i][0] < '0' || argv[i][0] > '9')
+					usage(argv[0]);
+				policy = kNUMAPolicyPreferred;
+				policy_node = strtoul(argv[i], &end, 0);
+				if (*end != '\0')
+					usage(argv[0]);
+			}
+		} else
+			usage(argv[0]);
+	}
+
+	if (bench) {
+		SIM_pfndb_bench(npages);
+		SIM_page_kernels_bench();
+		return 0;
+	}
+
+	vmparam.ws_page_expansion_count = 4;
+	vmparam.min_avail_for_expansion = 8;
+	vmparam.min_avail_for_alloc = 4;
+	vmparam.zeroed_target = 64;
+	vmparam.compact_order = VMP_LARGE_PAGE_ORDER;
+	vmparam.compact_threshold = 500;
+	vmparam.tier_scan_ns = NS_PER_S / 100;
+	vmparam.tier_promote_heat = 3;
+	vmparam.tier_fast_free_target = 16;
+	vmparam.merge_scan_ns = NS_PER_S / 50;
+	vmparam.merge_scan_pages = 64;
+
+	if (nnodes > 1 && npages <= (nnodes - 1) * VMP_SECTION_PAGES)
+		kfatal("All but the last NUMA node need %zu KiB or more\n",
+		    (size_t)VMP_SECTION_PAGES * PGSIZE / 1024);
+
+	/* memory hot-added goes above a hole of a section or more */
+	hotadd_base = hotadd_npages == 0 ? npages :
+	    (npages / VMP_SECTION_PAGES + 2) * VMP_SECTION_PAGES;
+
+	SIM_pages_init(npages, hotadd_base + hotadd_npages, nnodes, nslow);
 	SIM_paging_init();
+	vmp_cstore_init(cstore_npages);
 
 	vm_page_t *page;
-	vmp_page_alloc_locked(&page, kPageUsePML4, true);
-	page->process = &kernel_ps;
+	vmp_page_alloc(&page, kPageUsePML4, true);
+	vmp_page_cold(page)->process = &kernel_ps;
 	kernel_ps.pml4 = (void *)P2V(vmp_page_paddr(page));
 	kernel_ps.pml4_page = page;
-	vmparam.ws_page_expansion_count = 4;
-	vmparam.min_avail_for_expansion = 8;
-	vmparam.min_avail_for_alloc = 4;
 	RB_INIT(&kernel_ps.wsl.tree);
 	TAILQ_INIT(&kernel_ps.wsl.queue);
 	kernel_ps.wsl.nlocked = 0;
 	kernel_ps.wsl.nentries = 0;
 	kernel_ps.wsl.max = 4;
 	pthread_mutex_init(&kernel_ps.ws_lock, NULL);
+	ke_spinlock_init(&kernel_ps.wsl_lock);
+	kernel_ps.page_priority = VMP_STANDBY_PRIORITY_DEFAULT;
 
 	ke_event_init(&vmp_balancer_event, false);
 	ke_event_init(&vmp_pgwriter_event, false);
 	ke_event_init(&vmp_sufficient_pages_event, false);
+	ke_event_init(&vmp_zeroer_event, false);
+	ke_event_init(&vmp_compact_event, false);
+	ke_event_init(&vmp_tier_event, false);
+	ke_event_init(&vmp_merge_event, false);
 	pthread_create(&pgwriter_thread, NULL, vmp_pgwriter, NULL);
 	pthread_create(&balancer_thread, NULL, vmp_balancer, NULL);
+	pthread_create(&zeroer_thread, NULL, vmp_zeroer, NULL);
+	pthread_create(&compactor_thread, NULL, vmp_compactor, NULL);
+	pthread_create(&tier_thread, NULL, vmp_tier_migrator, NULL);
+	pthread_create(&merger_thread, NULL, vmp_merger, NULL);
 
 #if 0
 	printf("Wiring round 1\n");
@@ -107,6 +321,8 @@ main(int argc, char *arv[])
 
 	vaddr_t vaddr = 0x0;
 	vm_ps_allocate(&kernel_ps, &vaddr, 4294967296 * 32, true);
+	if (vm_ps_set_numa_policy(&kernel_ps, vaddr, policy, policy_node) != 0)
+		kfatal("Bad NUMA policy\n");
 
 #if 0
 	for (int i = 0; i < 10; i++) {
@@ -118,12 +334,37 @@ main(int argc, char *arv[])
 		}
 	}
 #else
+	if (balloon_npages != 0)
+		vm_balloon_set_target(balloon_npages);
+
 	for (int i = 0; i < 10; i++) {
+		/* halfway through, grow memory if asked */
+		if (i == 5 && hotadd_npages != 0 &&
+		    vm_page_hot_add(hotadd_base * PGSIZE,
+			hotadd_npages * PGSIZE, 0) != 0)
+			kfatal("Hot-add failed\n");
+		/*
+		 * each region is touched from a CPU on another node in turn,
+		 * so that first-touch placement follows it; the slow tier's
+		 * nodes have no CPUs.
+		 */
+		SIM_node = i % (nnodes - nslow);
 		for (int j = 0; j < 15; j++) {
 			bool write = true;
 			access((4294967296 * i) + PGSIZE * j, write);
 		}
 	}
+
+	/*
+	 * then read them all back: by now the early regions' pages, and with
+	 * little memory their page tables too, are paged out, so this has them
+	 * paged in again.
+	 */
+	for (int i = 0; i < 10; i++) {
+		SIM_node = i % (nnodes - nslow);
+		for (int j = 0; j < 15; j++)
+			access((4294967296 * i) + PGSIZE * j, false);
+	}
 #endif
 
 	vmp_wsl_dump(&kernel_ps);
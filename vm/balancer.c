@@ -11,18 +11,22 @@ vmp_balancer(void *)
 {
 	int32_t target;
 	kwaitstatus_t w;
-	ipl_t ipl;
+	bool balloon_more = false;
 
 loop:
-	w = ke_event_wait(&vmp_balancer_event, NS_PER_S);
+	/* while the balloon is making progress, don't wait between passes */
+	w = ke_event_wait(&vmp_balancer_event, balloon_more ? 0 : NS_PER_S);
 
-	printf("Balancer wakes\n");
+	/* the balloon is seen to on every pass, not only in a shortage */
+	balloon_more = vmp_balloon_inflate();
 
-	if (w == kKernWaitStatusOK)
-		target = vmparam.ws_page_expansion_count * 1;
-	else
+	if (w != kKernWaitStatusOK)
 		goto loop;
 
+	printf("Balancer wakes\n");
+
+	target = vmparam.ws_page_expansion_count * 1;
+
 	for (int i = 0; i < 1; i++) {
 		ke_wait(&kernel_ps.ws_lock, "vmp_balancer:ps->ws_lock", false,
 		    false, -1);
@@ -30,10 +34,8 @@ loop:
 		ke_mutex_release(&kernel_ps.ws_lock);
 	}
 
-	ipl = vmp_acquire_pfn_lock();
 	if (vmp_page_sufficience())
 		ke_event_clear(&vmp_balancer_event);
-	vmp_release_pfn_lock(ipl);
 
 	goto loop;
 }
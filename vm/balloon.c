@@ -0,0 +1,145 @@
+/*!
+ * @file balloon.c
+ * @brief The memory balloon, by which a host takes memory back from the VMM.
+ *
+ * The host sets a target number of pages with vm_balloon_set_target(). The
+ * balancer then inflates the balloon towards it, allocating pages and holding
+ * them (as kPageUseBalloon) where nothing else can use them. Allocation only
+ * proceeds while pages are available above the allocation reserve; when it
+ * stops, and not enough pages are inactive already, working sets are trimmed
+ * so that their pages go inactive and can be taken from the standby list on
+ * a later pass. A pass that gains nothing doesn't ask for another straight
+ * away, but the balancer's event stays signalled through a shortage, so passes
+ * go on regardless; a run of them gaining nothing is counted as one stall.
+ *
+ * Lowering the target deflates the balloon at once, freeing pages back.
+ *
+ * Locking: the balloon lock guards the target and the queue of pages held; it
+ * comes after page locks, and is never held while allocating or freeing.
+ */
+
+#include <sys/param.h>
+
+#include <kdk/executive.h>
+#include <kdk/nanokern.h>
+#include <kdk/vm.h>
+
+#include "vmp.h"
+
+/*! Most pages the balloon takes in one pass of the balancer. */
+#define BALLOON_BATCH 32
+
+static kspinlock_t balloon_lock = KSPINLOCK_INITIALISER;
+/*! Pages the host wants the balloon to hold. */
+static size_t balloon_target;
+/*! Pages the balloon holds, linked through their queue links. */
+static vmp_page_queue_t balloon_pgq = VMP_PGQ_INITIALIZER;
+static size_t balloon_npages;
+/*! Whether the last pass gained nothing. Only the balancer looks at this. */
+static bool balloon_stalled;
+
+/*! Give a page held by the balloon back. */
+static void
+balloon_page_free(vm_page_t *page)
+{
+	vmp_page_lock(page);
+	vmp_page_set_use(page, kPageUseDeleted);
+	vmp_page_unlock(page);
+	vmp_page_release(page);
+	vmp_stat_adjust(vmp_page_node(page), nballoon_deflated, 1);
+}
+
+void
+vm_balloon_set_target(size_t npages)
+{
+	vm_page_t *page;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&balloon_lock);
+	balloon_target = npages;
+	while (balloon_npages > balloon_target) {
+		page = vmp_pgq_first(&balloon_pgq);
+		vmp_pgq_remove(&balloon_pgq, page);
+		balloon_npages--;
+
+		ke_spinlock_release(&balloon_lock, ipl);
+		balloon_page_free(page);
+		ipl = ke_spinlock_acquire(&balloon_lock);
+	}
+	ke_spinlock_release(&balloon_lock, ipl);
+
+	ke_event_signal(&vmp_balancer_event);
+}
+
+size_t
+vm_balloon_target(void)
+{
+	size_t target;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&balloon_lock);
+	target = balloon_target;
+	ke_spinlock_release(&balloon_lock, ipl);
+
+	return target;
+}
+
+bool
+vmp_balloon_inflate(void)
+{
+	size_t want, got = 0, inactive;
+	vm_page_t *page;
+	bool more;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&balloon_lock);
+	want = balloon_target > balloon_npages ?
+	    MIN(balloon_target - balloon_npages, BALLOON_BATCH) :
+	    0;
+	ke_spinlock_release(&balloon_lock, ipl);
+
+	if (want == 0) {
+		balloon_stalled = false;
+		return false;
+	}
+
+	while (got < want) {
+		if (vmp_page_alloc(&page, kPageUseBalloon, false) != 0)
+			break;
+
+		ipl = ke_spinlock_acquire(&balloon_lock);
+		vmp_pgq_insert_tail(&balloon_pgq, page);
+		balloon_npages++;
+		ke_spinlock_release(&balloon_lock, ipl);
+
+		vmp_stat_adjust(vmp_page_node(page), nballoon_inflated, 1);
+		got++;
+	}
+
+	inactive = vmp_stat_read(&vmstat, nstandby) +
+	    vmp_stat_read(&vmstat, nmodified);
+	if (got < want && inactive < want - got) {
+		/*
+		 * Trim to make what's left available to take next time, but not
+		 * more than that: pages already inactive will do, once written.
+		 */
+		ke_wait(&kernel_ps.ws_lock, "vmp_balloon_inflate:ps->ws_lock",
+		    false, false, -1);
+		vmp_wsl_trim_n(&kernel_ps, want - got - inactive);
+		ke_mutex_release(&kernel_ps.ws_lock);
+	}
+
+	if (got == 0) {
+		if (!balloon_stalled)
+			vmp_stat_adjust(&vmp_nodes[0], nballoon_stalls, 1);
+		balloon_stalled = true;
+		return false;
+	}
+	balloon_stalled = false;
+
+	ipl = ke_spinlock_acquire(&balloon_lock);
+	more = balloon_npages < balloon_target;
+	ke_spinlock_release(&balloon_lock, ipl);
+
+	return more;
+}
@@ -0,0 +1,249 @@
+/*!
+ * @file compact.c
+ * @brief The compactor assembles free blocks of contiguous pages by moving
+ * anonymous pages out of their way.
+ *
+ * Over time the buddy allocator fragments: pages are freed in no particular
+ * order, so free memory ends up spread across many small blocks and contiguous
+ * allocations fail with plenty free. The compactor works a node at a time. A
+ * migration scanner walks blocks of 2^order pages up from the bottom of the
+ * node and moves the pages in use in each into free pages that a free scanner
+ * takes from the top, until the two meet. Blocks holding anything that can't
+ * be moved are passed over.
+ *
+ * Anonymous private pages mapped by small PTEs are moved, and so are the leaf
+ * page tables mapping them, which would otherwise pin a block in use for every
+ * 2 MiB of address space; see vmp_migrate_page().
+ */
+
+#include <sys/param.h>
+
+#include <kdk/executive.h>
+#include <kdk/libkern.h>
+#include <kdk/nanokern.h>
+#include <time.h>
+
+#include "vmp.h"
+
+/*! Most wakeups a node is passed over for after fruitless runs, as a shift. */
+#define DEFER_SHIFT_MAX 6
+/*! Blocks emptied between checks of the fragmentation index. */
+#define CHECK_BLOCKS 16
+
+kevent_t vmp_compact_event;
+
+/*! Order asked for by vmp_compact_request() on each node, plus 1; 0 if none. */
+static atomic_uint requested[VMP_MAX_NODES];
+/*! Wakeups to pass each node over for; and the shift for next time it fails. */
+static unsigned defer_count[VMP_MAX_NODES], defer_shift[VMP_MAX_NODES];
+
+struct compact_control {
+	struct vmp_node *node;
+	unsigned order;
+	/*! The free scanner takes pages below this, and at or above limit. */
+	pfn_t free_pfn, limit;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t)NS_PER_S + ts.tv_nsec;
+}
+
+/*!
+ * Get the share (per mille) of \p node's free memory that is not in free
+ * blocks of 2^order pages or more. Cached free pages count as unusable.
+ */
+static unsigned
+frag_index(struct vmp_node *node, unsigned order)
+{
+	size_t nfree = vmp_stat_read(&node->stat, nfree) +
+	    vmp_stat_read(&node->stat, nzeroed);
+	size_t usable = 0;
+	vm_page_t *page;
+	ipl_t ipl;
+
+	if (nfree == 0)
+		return 0;
+
+	ipl = ke_spinlock_acquire(&node->free_lock);
+	for (unsigned k = order; k < VMP_BUDDY_ORDERS; k++)
+		VMP_PGQ_FOREACH (page, &node->free_area[k])
+			usable += (size_t)1 << k;
+	ke_spinlock_release(&node->free_lock, ipl);
+
+	return (nfree - MIN(usable, nfree)) * 1000 / nfree;
+}
+
+/*!
+ * Take a free page to move a page into, from as high in the node as can be
+ * found, but no lower than the limit, which is the end of the block being
+ * emptied. Free blocks of the order being assembled are left alone.
+ */
+static vm_page_t *
+free_page_take(void *arg)
+{
+	struct compact_control *cc = arg;
+	vm_page_t *page = NULL;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&cc->node->free_lock);
+	while (page == NULL && cc->free_pfn > cc->limit)
+		page = vmp_buddy_alloc_pfn(cc->node, --cc->free_pfn,
+		    cc->order);
+	ke_spinlock_release(&cc->node->free_lock, ipl);
+
+	return page;
+}
+
+/*!
+ * Whether a page of use \p use may be movable: it is an anonymous page or a
+ * leaf page table.
+ */
+static bool
+use_movable(enum vm_page_use use)
+{
+	return use == kPageUseAnonPrivate || use == kPageUsePML1;
+}
+
+/*!
+ * Guess, without locking, whether the \p npages pages from \p base are worth
+ * emptying: they are all present and \p node's, some are in use, and all of
+ * those may be movable. A block lies within one section.
+ */
+static bool
+block_suitable(struct vmp_node *node, pfn_t base, size_t npages)
+{
+	size_t nused = 0;
+
+	if (!vmp_pfn_valid(base + npages - 1) ||
+	    vmp_pfn_section(base)->node != node->id)
+		return false;
+
+	for (size_t i = 0; i < npages; i++) {
+		enum vm_page_use use = vmp_pfn_to_page(base + i)->use;
+
+		if (use == kPageUseFree)
+			continue;
+		if (!use_movable(use))
+			return false;
+		nused++;
+	}
+
+	return nused > 0;
+}
+
+/*!
+ * Compact \p node until its fragmentation index for \p order is no more than
+ * the threshold, or the scanners meet. Returns whether the threshold was met.
+ */
+static bool
+compact_node(struct vmp_node *node, unsigned order)
+{
+	struct compact_control cc;
+	size_t block_pages = (size_t)1 << order, nblocks = 0;
+	unsigned after;
+	uint64_t start = now_ns(), elapsed;
+
+	cc.node = node;
+	cc.order = order;
+	cc.free_pfn = node->base_pfn + node->npages;
+
+	/* pages in the caches can't coalesce */
+	vmp_free_caches_reclaim();
+
+	for (pfn_t base = roundup(node->base_pfn, block_pages);
+	     base + block_pages <= cc.free_pfn; base += block_pages) {
+		if (!block_suitable(node, base, block_pages))
+			continue;
+
+		cc.limit = base + block_pages;
+		for (pfn_t pfn = base; pfn < cc.limit; pfn++) {
+			int r;
+
+			if (!use_movable(vmp_pfn_to_page(pfn)->use))
+				continue;
+
+			r = vmp_migrate_page(vmp_pfn_to_page(pfn),
+			    free_page_take, &cc);
+			if (r < 0)
+				goto done;
+			else if (r == 0)
+				vmp_stat_adjust(node, ncompact_moved, 1);
+		}
+
+		/* it walks the free lists, so is too dear to look at each time */
+		if (++nblocks % CHECK_BLOCKS == 0 &&
+		    frag_index(node, order) <= vmparam.compact_threshold)
+			break;
+	}
+
+done:
+	after = frag_index(node, order);
+	elapsed = now_ns() - start;
+
+	vmp_stat_adjust(node, ncompact_runs, 1);
+	vmp_stat_adjust(node, compact_ns, elapsed);
+
+	return after <= vmparam.compact_threshold;
+}
+
+void
+vmp_compact_request(unsigned nodeid, unsigned order)
+{
+	unsigned old = atomic_load_explicit(&requested[nodeid],
+	    memory_order_relaxed);
+
+	/* the largest order asked for serves the smaller asks too */
+	while (old < order + 1 &&
+	    !atomic_compare_exchange_weak_explicit(&requested[nodeid], &old,
+		order + 1, memory_order_relaxed, memory_order_relaxed))
+		;
+
+	ke_event_signal(&vmp_compact_event);
+}
+
+void *
+vmp_compactor(void *)
+{
+loop:
+	ke_event_wait(&vmp_compact_event, NS_PER_S);
+	ke_event_clear(&vmp_compact_event);
+
+	for (unsigned i = 0; i < vmp_nnodes; i++) {
+		struct vmp_node *node = &vmp_nodes[i];
+		unsigned order = vmparam.compact_order;
+		unsigned wanted = atomic_exchange_explicit(&requested[i], 0,
+		    memory_order_relaxed);
+		size_t nfree = vmp_stat_read(&node->stat, nfree) +
+		    vmp_stat_read(&node->stat, nzeroed);
+
+		if (wanted != 0)
+			order = wanted - 1;
+
+		/* no amount of compaction could give a block */
+		if (nfree < ((size_t)1 << order))
+			continue;
+
+		if (frag_index(node, order) <= vmparam.compact_threshold)
+			continue;
+
+		/* back off from nodes that compaction hasn't been helping */
+		if (defer_count[i] > 0) {
+			defer_count[i]--;
+			continue;
+		}
+
+		if (compact_node(node, order)) {
+			defer_shift[i] = 0;
+		} else {
+			defer_count[i] = 1u << defer_shift[i];
+			if (defer_shift[i] < DEFER_SHIFT_MAX)
+				defer_shift[i]++;
+		}
+	}
+
+	goto loop;
+}
@@ -0,0 +1,463 @@
+/*!
+ * @file cstore.c
+ * @brief The compressed store keeps modified pages compressed in memory, in
+ * front of the pagefile.
+ *
+ * A reserved set of physical pages is divided into chunks, and the page writer
+ * compresses each modified anonymous page into a run of chunks in one of them
+ * before it considers writing it to the pagefile; only pages that won't
+ * compress well enough, or that don't fit, are written out straight away. The
+ * page is then clean, with the store entry as its drumslot (marked by
+ * VMP_DRUMSLOT_CSTORE) and so in the swap PTE made when it is stolen. A fault
+ * on that PTE decompresses the entry instead of reading the pagefile.
+ *
+ * Entries are kept in least recently stored order. When the store gets full,
+ * the oldest are written back to the pagefile in batches, and their chunks
+ * freed. An entry lives on after writeback, naming the pagefile slot, so that
+ * the drumslots referring to it stay good; a fault on it reads that slot.
+ *
+ * Loads are exclusive: the entry is freed once its contents are in a page, so
+ * the page is dirty again. Pages are compressed by coding each 64-bit word as
+ * zero, a repeat of the word before, or a literal, which catches the zeroed
+ * and patterned memory common in anonymous pages at little cost.
+ *
+ * Locking: the store lock guards everything here. It comes after page locks,
+ * and before the pagefile lock.
+ */
+
+#include <sys/param.h>
+
+#include <kdk/io.h>
+#include <kdk/libkern.h>
+#include <kdk/nanokern.h>
+#include <string.h>
+
+#include "vmp.h"
+
+#define CSTORE_CHUNK 256
+#define CSTORE_PAGE_CHUNKS (PGSIZE / CSTORE_CHUNK)
+/*! Largest compressed page kept; worse-compressing pages go to the pagefile. */
+#define CSTORE_MAX_SIZE (PGSIZE * 3 / 4)
+/*! Entries written back to the pagefile at a time. */
+#define CSTORE_WRITEBACK_BATCH 8
+
+#define WORDS_PER_PAGE (PGSIZE / sizeof(uint64_t))
+/*! Bytes of 2-bit word tags at the start of a compressed page. */
+#define TAG_BYTES (WORDS_PER_PAGE / 4)
+
+enum word_tag {
+	kWordZero,
+	kWordRepeat,
+	kWordLiteral,
+};
+
+enum cstore_state {
+	kCStoreFree,
+	/*! Compressed in the store. */
+	kCStoreStored,
+	/*! Compressed in the store, and being written to the pagefile. */
+	kCStoreWriteback,
+	/*! Loaded or freed while being written back; freed when that ends. */
+	kCStoreDead,
+	/*! Written back to the pagefile slot drumslot. */
+	kCStoreOnDisk,
+};
+
+struct cstore_entry {
+	/*! Link on the LRU list while stored, or on the free list. */
+	TAILQ_ENTRY(cstore_entry) link;
+	enum cstore_state state;
+	/*! Compressed size in bytes. */
+	uint16_t size;
+	/*! Where the compressed page is: page of the store, and chunk in it. */
+	uint32_t store_page;
+	uint8_t chunk;
+	uintptr_t drumslot;
+};
+
+static kspinlock_t cstore_lock = KSPINLOCK_INITIALISER;
+static vm_page_t **store_pages;
+/*! Bit n set if chunk n of the store page is in use. */
+static uint16_t *chunk_maps;
+static size_t nstore_pages, nchunks_used;
+static struct cstore_entry *entries;
+static size_t nentries;
+static TAILQ_HEAD(, cstore_entry) lru = TAILQ_HEAD_INITIALIZER(lru),
+				  free_entries = TAILQ_HEAD_INITIALIZER(
+				      free_entries);
+/*! Pages to decompress entries into for writeback, and their MDLs. */
+static vm_page_t *bounce_pages[CSTORE_WRITEBACK_BATCH];
+static vm_mdl_t *bounce_mdls[CSTORE_WRITEBACK_BATCH];
+
+void
+vmp_cstore_init(size_t npages)
+{
+	/*
+	 * the pages are wired for good, so beyond them must be left the
+	 * reserve, room above it for working sets to grow, and a walk's worth
+	 * of page tables along with the page they map; else the first fault
+	 * waits forever for free pages.
+	 */
+	size_t spare = vmparam.min_avail_for_alloc * 2 +
+	    vmparam.min_avail_for_expansion + VMP_TABLE_LEVELS + 1;
+
+	if (npages == 0)
+		return;
+
+	if (npages + CSTORE_WRITEBACK_BATCH + spare > vmp_free_pages())
+		kfatal("Compressed store of %zu pages leaves too few of %zu "
+		       "free\n",
+		    npages, (size_t)vmp_free_pages());
+
+	store_pages = kmem_alloc(sizeof(vm_page_t *) * npages);
+	chunk_maps = kmem_alloc(sizeof(uint16_t) * npages);
+	for (size_t i = 0; i < npages; i++) {
+		vmp_page_alloc(&store_pages[i], kPageUseKWired, true);
+		chunk_maps[i] = 0;
+	}
+
+	for (size_t i = 0; i < CSTORE_WRITEBACK_BATCH; i++) {
+		vmp_page_alloc(&bounce_pages[i], kPageUseKWired, true);
+		vm_mdl_alloc(&bounce_mdls[i], 1);
+	}
+
+	/* every entry holds a chunk or a pagefile slot */
+	nentries = npages * CSTORE_PAGE_CHUNKS + vmp_pagefile.total_slots;
+	entries = kmem_alloc(sizeof(struct cstore_entry) * nentries);
+	for (size_t i = 0; i < nentries; i++) {
+		entries[i].state = kCStoreFree;
+		TAILQ_INSERT_TAIL(&free_entries, &entries[i], link);
+	}
+
+	nstore_pages = npages;
+}
+
+/*!
+ * Compress the page at \p in into \p out, which has room for CSTORE_MAX_SIZE
+ * bytes. Returns the compressed size, or 0 if it won't fit.
+ */
+static size_t
+compress_page(const uint64_t *in, uint8_t *out)
+{
+	size_t len = TAG_BYTES;
+	uint64_t prev = 0;
+
+	memset(out, 0, TAG_BYTES);
+
+	for (size_t i = 0; i < WORDS_PER_PAGE; i++) {
+		enum word_tag tag;
+
+		if (in[i] == 0) {
+			tag = kWordZero;
+		} else if (in[i] == prev) {
+			tag = kWordRepeat;
+		} else {
+			if (len + sizeof(uint64_t) > CSTORE_MAX_SIZE)
+				return 0;
+			memcpy(&out[len], &in[i], sizeof(uint64_t));
+			len += sizeof(uint64_t);
+			tag = kWordLiteral;
+		}
+
+		out[i / 4] |= tag << (i % 4 * 2);
+		prev = in[i];
+	}
+
+	return len;
+}
+
+static void
+decompress_page(const uint8_t *in, uint64_t *out)
+{
+	size_t len = TAG_BYTES;
+	uint64_t prev = 0;
+
+	for (size_t i = 0; i < WORDS_PER_PAGE; i++) {
+		switch ((in[i / 4] >> (i % 4 * 2)) & 3) {
+		case kWordZero:
+			out[i] = 0;
+			break;
+
+		case kWordRepeat:
+			out[i] = prev;
+			break;
+
+		case kWordLiteral:
+			memcpy(&out[i], &in[len], sizeof(uint64_t));
+			len += sizeof(uint64_t);
+			break;
+
+		default:
+			kfatal("Bad compressed page\n");
+		}
+
+		prev = out[i];
+	}
+}
+
+static uint16_t
+entry_chunk_mask(struct cstore_entry *entry)
+{
+	size_t nchunks = howmany(entry->size, CSTORE_CHUNK);
+	return ((1u << nchunks) - 1) << entry->chunk;
+}
+
+static void *
+entry_data(struct cstore_entry *entry)
+{
+	return (void *)(vm_page_direct_map_addr(store_pages[entry->store_page]) +
+	    entry->chunk * CSTORE_CHUNK);
+}
+
+static struct vmp_node *
+entry_node(struct cstore_entry *entry)
+{
+	return vmp_page_node(store_pages[entry->store_page]);
+}
+
+/*! Find room for \p entry's compressed page, first fit. */
+static bool
+chunks_alloc(struct cstore_entry *entry) LOCK_REQUIRES(cstore_lock)
+{
+	size_t nchunks = howmany(entry->size, CSTORE_CHUNK);
+	uint16_t mask = (1u << nchunks) - 1;
+
+	for (size_t i = 0; i < nstore_pages; i++) {
+		for (unsigned chunk = 0; chunk + nchunks <= CSTORE_PAGE_CHUNKS;
+		     chunk++) {
+			if ((chunk_maps[i] & (mask << chunk)) == 0) {
+				chunk_maps[i] |= mask << chunk;
+				nchunks_used += nchunks;
+				entry->store_page = i;
+				entry->chunk = chunk;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static void
+chunks_free(struct cstore_entry *entry) LOCK_REQUIRES(cstore_lock)
+{
+	chunk_maps[entry->store_page] &= ~entry_chunk_mask(entry);
+	nchunks_used -= howmany(entry->size, CSTORE_CHUNK);
+	vmp_stat_adjust(entry_node(entry), cstore_pages, -1);
+	vmp_stat_adjust(entry_node(entry), cstore_bytes, -(ssize_t)entry->size);
+}
+
+static void
+entry_free(struct cstore_entry *entry) LOCK_REQUIRES(cstore_lock)
+{
+	entry->state = kCStoreFree;
+	TAILQ_INSERT_HEAD(&free_entries, entry, link);
+}
+
+static struct cstore_entry *
+handle_entry(uintptr_t handle)
+{
+	size_t index = handle & ~VMP_DRUMSLOT_CSTORE;
+
+	kassert(vmp_drumslot_is_cstore(handle) && index < nentries);
+	return &entries[index];
+}
+
+uintptr_t
+vmp_cstore_put(vm_page_t *page)
+{
+	uint8_t buf[CSTORE_MAX_SIZE];
+	struct cstore_entry *entry;
+	size_t size;
+	ipl_t ipl;
+
+	if (nstore_pages == 0)
+		return -1;
+
+	size = compress_page((uint64_t *)vm_page_direct_map_addr(page), buf);
+	if (size == 0) {
+		vmp_stat_adjust(vmp_page_node(page), ncstore_rejected, 1);
+		return -1;
+	}
+
+	ipl = ke_spinlock_acquire(&cstore_lock);
+	entry = TAILQ_FIRST(&free_entries);
+	kassert(entry != NULL);
+	entry->size = size;
+	if (!chunks_alloc(entry)) {
+		ke_spinlock_release(&cstore_lock, ipl);
+		/* the page writer writes entries back to make room */
+		ke_event_signal(&vmp_pgwriter_event);
+		return -1;
+	}
+
+	TAILQ_REMOVE(&free_entries, entry, link);
+	entry->state = kCStoreStored;
+	memcpy(entry_data(entry), buf, size);
+	TAILQ_INSERT_TAIL(&lru, entry, link);
+
+	vmp_stat_adjust(entry_node(entry), ncstore_stored, 1);
+	vmp_stat_adjust(entry_node(entry), cstore_pages, 1);
+	vmp_stat_adjust(entry_node(entry), cstore_bytes, size);
+	ke_spinlock_release(&cstore_lock, ipl);
+
+	return (entry - entries) | VMP_DRUMSLOT_CSTORE;
+}
+
+int
+vmp_cstore_load(uintptr_t handle, vm_page_t *page, uintptr_t *drumslot)
+{
+	struct cstore_entry *entry = handle_entry(handle);
+	int r = 0;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&cstore_lock);
+	switch (entry->state) {
+	case kCStoreStored:
+		decompress_page(entry_data(entry),
+		    (uint64_t *)vm_page_direct_map_addr(page));
+		vmp_stat_adjust(entry_node(entry), ncstore_loaded, 1);
+		TAILQ_REMOVE(&lru, entry, link);
+		chunks_free(entry);
+		entry_free(entry);
+		break;
+
+	case kCStoreWriteback:
+		/* the chunks are freed once the write is done */
+		decompress_page(entry_data(entry),
+		    (uint64_t *)vm_page_direct_map_addr(page));
+		vmp_stat_adjust(entry_node(entry), ncstore_loaded, 1);
+		entry->state = kCStoreDead;
+		break;
+
+	case kCStoreOnDisk:
+		*drumslot = entry->drumslot;
+		entry_free(entry);
+		r = 1;
+		break;
+
+	default:
+		kfatal("Load of compressed store entry in state %d\n",
+		    entry->state);
+	}
+	ke_spinlock_release(&cstore_lock, ipl);
+
+	return r;
+}
+
+void
+vmp_cstore_free(uintptr_t handle)
+{
+	struct cstore_entry *entry = handle_entry(handle);
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&cstore_lock);
+	switch (entry->state) {
+	case kCStoreStored:
+		TAILQ_REMOVE(&lru, entry, link);
+		chunks_free(entry);
+		entry_free(entry);
+		break;
+
+	case kCStoreWriteback:
+		entry->state = kCStoreDead;
+		break;
+
+	case kCStoreOnDisk:
+		vmp_pagefile_free(&vmp_pagefile, entry->drumslot);
+		entry_free(entry);
+		break;
+
+	default:
+		kfatal("Free of compressed store entry in state %d\n",
+		    entry->state);
+	}
+	ke_spinlock_release(&cstore_lock, ipl);
+}
+
+void
+vmp_drumslot_free(uintptr_t drumslot)
+{
+	if (vmp_drumslot_is_cstore(drumslot))
+		vmp_cstore_free(drumslot);
+	else
+		vmp_pagefile_free(&vmp_pagefile, drumslot);
+}
+
+/*!
+ * Write back one batch of the oldest entries. Returns false if there were
+ * none to write, or no pagefile slots to write them to.
+ */
+static bool
+writeback_batch(void)
+{
+	struct cstore_entry *batch[CSTORE_WRITEBACK_BATCH];
+	iop_t iops[CSTORE_WRITEBACK_BATCH];
+	size_t n = 0;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&cstore_lock);
+	while (n < CSTORE_WRITEBACK_BATCH && !TAILQ_EMPTY(&lru)) {
+		struct cstore_entry *entry = TAILQ_FIRST(&lru);
+		uintptr_t slot = vmp_pagefile_alloc(&vmp_pagefile);
+
+		if (slot == -1)
+			break;
+
+		TAILQ_REMOVE(&lru, entry, link);
+		entry->state = kCStoreWriteback;
+		entry->drumslot = slot;
+		decompress_page(entry_data(entry),
+		    (uint64_t *)vm_page_direct_map_addr(bounce_pages[n]));
+		batch[n++] = entry;
+	}
+	ke_spinlock_release(&cstore_lock, ipl);
+
+	if (n == 0)
+		return false;
+
+	for (size_t i = 0; i < n; i++) {
+		vm_mdl_t *mdl = bounce_mdls[i];
+
+		mdl->offset = 0;
+		mdl->nentries = 1;
+		mdl->pages[0] = bounce_pages[i];
+		ke_event_init(&iops[i].event, false);
+		iop_init_vnode_write(&iops[i], vmp_pagefile.vnode, mdl, PGSIZE,
+		    batch[i]->drumslot * PGSIZE);
+		iop_send(&iops[i]);
+	}
+
+	for (size_t i = 0; i < n; i++)
+		ke_event_wait(&iops[i].event, -1);
+
+	ipl = ke_spinlock_acquire(&cstore_lock);
+	for (size_t i = 0; i < n; i++) {
+		struct cstore_entry *entry = batch[i];
+
+		vmp_stat_adjust(entry_node(entry), ncstore_written, 1);
+		chunks_free(entry);
+		if (entry->state == kCStoreDead) {
+			vmp_pagefile_free(&vmp_pagefile, entry->drumslot);
+			entry_free(entry);
+		} else {
+			entry->state = kCStoreOnDisk;
+		}
+	}
+	ke_spinlock_release(&cstore_lock, ipl);
+
+	return n == CSTORE_WRITEBACK_BATCH;
+}
+
+void
+vmp_cstore_writeback(void)
+{
+	size_t nchunks = nstore_pages * CSTORE_PAGE_CHUNKS;
+
+	/* past three quarters full, write back until half full */
+	if (nstore_pages == 0 || nchunks_used * 4 < nchunks * 3)
+		return;
+
+	while (nchunks_used * 2 > nchunks && writeback_batch())
+		;
+}
@@ -7,7 +7,7 @@
 #include "vmp.h"
 
 struct vmp_pager_state *
-vmp_pager_state_alloc()
+vmp_pager_state_alloc(void)
 {
 	vmp_pager_state_t *state = kmem_alloc(sizeof(*state));
 	if (state == NULL)
@@ -17,6 +17,115 @@ vmp_pager_state_alloc()
 	return state;
 }
 
+/*!
+ * Whether a fault at \p vaddr may be satisfied with a large page: the VAD must
+ * be anonymous and cover the whole naturally aligned large page around it,
+ * and there must be plenty of free memory to take one from.
+ */
+static bool
+large_page_eligible(vm_vad_t *vad, vaddr_t vaddr)
+{
+	vaddr_t base = vaddr & ~(VMP_LARGE_PAGE_SIZE - 1);
+
+	return vad->section == NULL && base >= vad->start &&
+	    base + VMP_LARGE_PAGE_SIZE <= vad->end &&
+	    vmp_free_pages() >=
+	    VMP_LARGE_PAGE_PAGES + vmparam.min_avail_for_alloc * 2;
+}
+
+/*!
+ * Whether \p vaddr is already mapped by a large page. Faults on it must go
+ * through fault_large() whatever the state of free memory, as the small-page
+ * walk cannot descend through a large leaf.
+ */
+static bool
+large_page_mapped(eprocess_t *ps, vaddr_t vaddr) LOCK_REQUIRES(ps->ws_lock)
+{
+	pte_t *pte;
+
+	return vmp_fetch_pte_level(ps, vaddr, VMP_LARGE_PAGE_LEVEL, &pte) ==
+	    0 && vmp_pte_characterise(pte) == kPTEKindValid &&
+	    vmp_pte_hw_is_large(pte);
+}
+
+/*! Give back the pages of a large page never mapped. */
+static void
+large_page_free(vm_page_t *page)
+{
+	for (size_t i = 0; i < VMP_LARGE_PAGE_PAGES; i++) {
+		vmp_page_set_use(&page[i], kPageUseDeleted);
+		vmp_page_release(&page[i]);
+	}
+}
+
+/*!
+ * Try to handle a fault with a large page mapped by a PML2 PTE. Returns 1 if
+ * the fault is to be handled with small pages instead: there is a page table
+ * where the large page would go, or no large page could be had.
+ */
+static int
+fault_large(eprocess_t *ps, vm_vad_t *vad, vaddr_t vaddr, bool write,
+    vm_mdl_t *out) LOCK_REQUIRES(ps->ws_lock)
+{
+	vaddr_t base = vaddr & ~(VMP_LARGE_PAGE_SIZE - 1);
+	size_t index = (vaddr - base) / PGSIZE;
+	struct vmp_pte_wire_state pte_state;
+	enum vmp_pte_kind pte_kind;
+	vm_page_t *page;
+	pte_t *pte;
+	int r;
+
+	if (vmp_wire_pte_level(ps, vaddr, VMP_LARGE_PAGE_LEVEL,
+		&pte_state) != 0)
+		return 1;
+	pte = pte_state.pte;
+	pte_kind = vmp_pte_characterise(pte);
+
+	if (pte_kind == kPTEKindValid && vmp_pte_hw_is_large(pte)) {
+		/* dirty-bit emulation, as for small pages */
+		if (write)
+			pte->hw.writeable = true;
+		page = vmp_pte_hw_page(pte, VMP_LARGE_PAGE_LEVEL);
+	} else if (pte_kind == kPTEKindZero && write) {
+		/* reads map the zero page instead, see do_fault() */
+		r = vmp_page_alloc_order_node(&page, vmp_vad_node(vad, base),
+		    VMP_LARGE_PAGE_ORDER, kPageUseAnonPrivate, false);
+		if (r != 0)
+			goto small;
+
+		if (vmp_wsl_insert_large(ps, base) != 0) {
+			large_page_free(page);
+			goto small;
+		}
+
+		for (size_t i = 0; i < VMP_LARGE_PAGE_PAGES; i++) {
+			vmp_page_cold(&page[i])->process = ps;
+			vmp_page_cold(&page[i])->referent_pte = V2P(pte);
+		}
+		vmp_pte_hw_large_create(pte, page->pfn,
+		    write & vad->flags.writeable);
+		vmp_pagetable_page_nonswap_pte_created(ps,
+		    pte_state.pages[VMP_LARGE_PAGE_LEVEL - 1], true);
+		vmp_stat_adjust(vmp_page_node(page), nlarge, 1);
+	} else
+		goto small;
+
+	vmp_stat_adjust(&vmp_nodes[vmp_current_node()], nfault[pte_kind], 1);
+
+	if (out != NULL) {
+		vmp_page_retain(&page[index]);
+		out->pages[out->offset / PGSIZE] = &page[index];
+		out->offset += PGSIZE;
+	}
+
+	vmp_pte_wire_state_release(&pte_state);
+	return 0;
+
+small:
+	vmp_pte_wire_state_release(&pte_state);
+	return 1;
+}
+
 static int
 do_fault(vaddr_t vaddr, bool write, vm_mdl_t *out)
 {
@@ -24,7 +133,6 @@ do_fault(vaddr_t vaddr, bool write, vm_mdl_t *out)
 	struct vmp_pte_wire_state pte_state;
 	enum vmp_pte_kind pte_kind;
 	vm_vad_t *vad;
-	ipl_t ipl;
 	int ret = 0;
 
 	ke_wait(&ps->vad_lock, "vm_fault:ps->vad_lock", false, false, -1);
@@ -34,8 +142,18 @@ do_fault(vaddr_t vaddr, bool write, vm_mdl_t *out)
 
 	ke_wait(&ps->ws_lock, "vm_fault:ps->ws_lock", false, false, -1);
 
-	vmp_wire_pte(ps, vaddr, &pte_state);
-	ipl = vmp_acquire_pfn_lock();
+	if ((large_page_mapped(ps, vaddr) || large_page_eligible(vad, vaddr)) &&
+	    fault_large(ps, vad, vaddr, write, out) == 0)
+		goto out_no_pte_wire_state_release;
+
+	if (vmp_wire_pte(ps, vaddr, &pte_state) != 0) {
+		ret = -1;
+		goto out_no_pte_wire_state_release;
+	}
+	vmp_stat_adjust(&vmp_nodes[vmp_current_node()],
+	    nfault[vmp_pte_characterise(pte_state.pte)], 1);
+
+recharacterise:
 	pte_kind = vmp_pte_characterise(pte_state.pte);
 
 	if (pte_kind == kPTEKindValid &&
@@ -50,41 +168,102 @@ do_fault(vaddr_t vaddr, bool write, vm_mdl_t *out)
 
 		if (vad->flags.cow) {
 			kfatal("cow section fault\n");
-		} else if (false /* page is fork anon */) {
+		} else if (vmp_pte_hw_page(pte_state.pte, 1) == vmp_zero_page) {
+			/* first write to memory only read so far */
+			vm_page_t *page;
+			int r;
+
+			r = vmp_page_alloc_node(&page, vmp_vad_node(vad, vaddr),
+			    kPageUseAnonPrivate, false);
+			if (r != 0) {
+				ret = r;
+				goto out;
+			}
+
+			/* the PTE stays valid, so the table's counts hold */
+			vmp_page_cold(page)->process = ps;
+			vmp_page_cold(page)->referent_pte = V2P(pte_state.pte);
+			/* the TLB entry would be flushed here */
+			vmp_pte_hw_create(pte_state.pte, page->pfn, true);
+
+			if (out != NULL) {
+				vmp_page_retain(page);
+				out->pages[out->offset / PGSIZE] = page;
+				out->offset += PGSIZE;
+			}
+		} else if (vmp_pte_hw_page(pte_state.pte, 1)->use ==
+		    kPageUseForkPage) {
+			/* a merged page; see vm/merge.c */
+			vm_page_t *page;
+			int r;
+
+			r = vmp_merge_break(ps, vad, vaddr, pte_state.pte,
+			    &page);
+			if (r != 0) {
+				ret = r;
+				goto out;
+			}
+
+			if (out != NULL) {
+				vmp_page_retain(page);
+				out->pages[out->offset / PGSIZE] = page;
+				out->offset += PGSIZE;
+			}
 		} else {
 			pte_state.pte->hw.writeable = true;
 			if (out != NULL) {
 				vm_page_t *page = vmp_pte_hw_page(pte_state.pte,
 				    1);
-				vmp_page_retain_locked(page);
+				vmp_page_retain(page);
 				out->pages[out->offset / PGSIZE] = page;
 				out->offset += PGSIZE;
 			}
 		}
 	} else if (pte_kind == kPTEKindZero) {
-		if (vad->section == NULL) {
+		if (vad->section == NULL && !write) {
+			/*
+			 * reads of memory never written map the zero page,
+			 * read-only; a write fault gives it a page of its own.
+			 * the zero page is never freed, so isn't retained for
+			 * each mapping.
+			 */
+			vmp_pte_hw_create(pte_state.pte, vmp_zero_page->pfn,
+			    false);
+			vmp_pagetable_page_nonswap_pte_created(ps,
+			    pte_state.pages[0], true);
+			vmp_wsl_insert(ps, vaddr, false, false);
+			vmp_stat_adjust(&vmp_nodes[vmp_current_node()],
+			    nzero_page_mapped, 1);
+
+			if (out != NULL) {
+				vmp_page_retain(vmp_zero_page);
+				out->pages[out->offset / PGSIZE] = vmp_zero_page;
+				out->offset += PGSIZE;
+			}
+		} else if (vad->section == NULL) {
 			/*! demand paged zero */
 
 			vm_page_t *page;
 			int r;
 
-			r = vmp_page_alloc_locked(&page, kPageUseAnonPrivate,
-			    false);
+			r = vmp_page_alloc_node(&page, vmp_vad_node(vad, vaddr),
+			    kPageUseAnonPrivate, false);
 			if (r != 0) {
 				ret = r;
 				goto out;
 			}
 
-			page->process = ps;
+			vmp_page_cold(page)->process = ps;
 			vmp_pte_hw_create(pte_state.pte, page->pfn,
 			    write & vad->flags.writeable);
 			vmp_pagetable_page_nonswap_pte_created(ps,
 			    pte_state.pages[0], true);
 			vmp_wsl_insert(ps, vaddr, false, false);
-			page->referent_pte = V2P(pte_state.pte);
+			vmp_page_cold(page)->referent_pte = V2P(
+			    pte_state.pte);
 
 			if (out != NULL) {
-				vmp_page_retain_locked(page);
+				vmp_page_retain(page);
 				out->pages[out->offset / PGSIZE] = page;
 				out->offset += PGSIZE;
 			}
@@ -93,36 +272,99 @@ do_fault(vaddr_t vaddr, bool write, vm_mdl_t *out)
 		}
 	} else if (pte_kind == kPTEKindTrans) {
 		vm_page_t *page = vmp_pte_trans_page(pte_state.pte);
+
+		/*
+		 * the page may be stolen (and its PTE made swap) right up until
+		 * its lock is held, so check it is still ours.
+		 */
+		vmp_page_lock(page);
+		if (vmp_pte_characterise(pte_state.pte) != kPTEKindTrans ||
+		    pte_state.pte->trans.pfn != page->pfn) {
+			vmp_page_unlock(page);
+			goto recharacterise;
+		}
 		vmp_page_retain_locked(page);
+		vmp_page_cold(page)->reused = true;
 		vmp_pte_hw_create(pte_state.pte, page->pfn, false);
+		vmp_page_unlock(page);
 		vmp_wsl_insert(ps, vaddr, false, false);
 		if (out != NULL && !write) {
-			vmp_page_retain_locked(page);
+			vmp_page_retain(page);
 			out->pages[out->offset / PGSIZE] = page;
 			out->offset += PGSIZE;
 		}
 	} else if (pte_kind == kPTEKindValid) {
 		if (out != NULL) {
 			vm_page_t *page = vmp_pte_hw_page(pte_state.pte, 1);
-			vmp_page_retain_locked(page);
+			vmp_page_retain(page);
 			out->pages[out->offset / PGSIZE] = page;
 			out->offset += PGSIZE;
 		}
+	} else if (pte_kind == kPTEKindBusy) {
+		/* another fault is reading the page in; wait, then try again */
+		vmp_pager_state_t *state = vmp_pte_busy_state(pte_state.pte);
+
+		state->refcount++;
+		vmp_pte_wire_state_release(&pte_state);
+		ke_mutex_release(&ps->ws_lock);
+		ke_mutex_release(&ps->vad_lock);
+
+		ke_event_wait(&state->event, -1);
+
+		ke_wait(&ps->ws_lock, "vm_fault: reacquire ws_lock", false,
+		    false, -1);
+		vmp_pager_state_release(state);
+		ke_mutex_release(&ps->ws_lock);
+
+		return 1;
 	} else if (pte_kind == kPTEKindSwap) {
 
 		struct vmp_pager_state *pager_state;
 		vm_mdl_t *mdl;
 		vm_page_t *page;
+		uintptr_t drumslot = vmp_pte_swap_drumslot(pte_state.pte);
+		bool no_io = false;
 		iop_t iop;
 		int r;
 
-		r = vmp_page_alloc_locked(&page, kPageUseAnonPrivate, false);
+		r = vmp_page_alloc_node(&page, vmp_vad_node(vad, vaddr),
+		    kPageUseAnonPrivate, false);
 		if (r != 0) {
 			ret = r;
 			goto out;
 		}
-		page->process = ps;
-		page->referent_pte = V2P(pte_state.pte);
+		vmp_page_cold(page)->process = ps;
+		vmp_page_cold(page)->referent_pte = V2P(pte_state.pte);
+		vmp_page_cold(page)->reused = true;
+
+		/*
+		 * a page with no backing copy was never written, so is zeroes,
+		 * as the new page is already. one in the compressed store is
+		 * there to be had without I/O too; the load frees the entry, so
+		 * the page is dirty. if the entry had been written back, it gave
+		 * up the slot for us to read.
+		 */
+		if (drumslot == -1) {
+			no_io = true;
+		} else if (vmp_drumslot_is_cstore(drumslot) &&
+		    vmp_cstore_load(drumslot, page, &drumslot) == 0) {
+			page->dirty = true;
+			no_io = true;
+		}
+
+		if (no_io) {
+			vmp_pte_hw_create(pte_state.pte, page->pfn, false);
+			vmp_pagetable_page_nonswap_pte_created(ps,
+			    pte_state.pages[0], false);
+			vmp_wsl_insert(ps, vaddr, false, false);
+			if (out != NULL) {
+				vmp_page_retain(page);
+				out->pages[out->offset / PGSIZE] = page;
+				out->offset += PGSIZE;
+			}
+			goto out;
+		}
+		vmp_page_cold(page)->drumslot = drumslot;
 
 		pager_state = vmp_pager_state_alloc();
 		vm_mdl_alloc(&mdl, 1);
@@ -135,7 +377,6 @@ do_fault(vaddr_t vaddr, bool write, vm_mdl_t *out)
 		vmp_wsl_insert(ps, vaddr, false, true);
 
 		vmp_pte_wire_state_release(&pte_state);
-		vmp_release_pfn_lock(ipl);
 		ke_mutex_release(&ps->ws_lock);
 		ke_mutex_release(&ps->vad_lock);
 
@@ -145,19 +386,19 @@ do_fault(vaddr_t vaddr, bool write, vm_mdl_t *out)
 
 		ke_event_init(&iop.event, false);
 		iop_init_vnode_read(&iop, vmp_pagefile.vnode, mdl, PGSIZE,
-		    page->drumslot * PGSIZE);
+		    vmp_page_cold(page)->drumslot * PGSIZE);
 		iop_send(&iop);
 
 		ke_event_wait(&iop.event, -1);
+		kmem_free(mdl, sizeof(*mdl) + sizeof(vm_page_t *));
 
 		ke_wait(&ps->vad_lock, "ps->vad_lock reacquire swapin", false,
 		    false, -1);
 		ke_wait(&ps->ws_lock, "ps->ws_lock reacquire swapin", false,
 		    false, -1);
-		vmp_acquire_pfn_lock();
 
 		if (out != NULL) {
-			vmp_page_retain_locked(page);
+			vmp_page_retain(page);
 			out->pages[out->offset / PGSIZE] = page;
 			out->offset += PGSIZE;
 		}
@@ -165,6 +406,10 @@ do_fault(vaddr_t vaddr, bool write, vm_mdl_t *out)
 		vmp_pte_hw_create(pte_state.pte, page->pfn, false);
 		vmp_wsl_unlock_entry(ps, vaddr);
 
+		/* wake faults that found the PTE busy, and drop our reference */
+		ke_event_signal(&pager_state->event);
+		vmp_pager_state_release(pager_state);
+
 		goto out_no_pte_wire_state_release;
 	} else {
 		kfatal("Unhandled PTE kind %d\n", pte_kind);
@@ -173,7 +418,6 @@ do_fault(vaddr_t vaddr, bool write, vm_mdl_t *out)
 out:
 	vmp_pte_wire_state_release(&pte_state);
 out_no_pte_wire_state_release:
-	vmp_release_pfn_lock(ipl);
 	ke_mutex_release(&ps->ws_lock);
 	ke_mutex_release(&ps->vad_lock);
 
@@ -195,6 +439,9 @@ retry:
 		ke_event_wait(&vmp_sufficient_pages_event, -1);
 		goto retry;
 
+	case 1:
+		goto retry;
+
 	default:
 		kfatal("Unexpected return value from do_fault\n");
 	}
@@ -0,0 +1,395 @@
+/*!
+ * @file merge.c
+ * @brief The page merger finds anonymous pages with the same contents and
+ * shares one copy between them.
+ *
+ * The merger walks the working set a few pages at a time, at a rate set by
+ * vm_merge_set_rate(), and hashes each anonymous private page. A page whose
+ * hash matches a merged page's is compared with it and, if it is the same,
+ * its mapping is pointed at the merged page and it is freed. Otherwise the
+ * page is remembered in a table of candidates for the rest of the pass; a
+ * later page matching a candidate is compared with it, and if they are the
+ * same, the candidate becomes a merged page and the later page is merged into
+ * it.
+ *
+ * A merged page is a fork page (kPageUseForkPage): its struct vmp_forkpage
+ * counts the PTEs mapping it, each of which holds a reference to it, and it
+ * is mapped read-only. A write fault on it is a copy-on-write fault, handled
+ * by vmp_merge_break(), which gives the mapping back a private page.
+ *
+ * Merged pages aren't paged out: a page has only the one referent PTE, which
+ * the standby and modified lists need to turn a page's mapping into a swap
+ * PTE when it is stolen. So the working set list entries of mappings of a
+ * merged page are locked, as are those of page tables with valid PTEs, and
+ * to leave enough of a working set to trim, no page is merged once half the
+ * working set is locked.
+ *
+ * Locking: the merge index (of merged pages by hash) has its own lock, which
+ * comes after page locks. The candidate table belongs to the merger thread.
+ */
+
+#include <kdk/executive.h>
+#include <kdk/libkern.h>
+#include <kdk/nanokern.h>
+#include <string.h>
+
+#include "vmp.h"
+
+/*! Buckets in the merge index. */
+#define MERGE_BUCKETS 256
+/*! Entries in the candidate table; a pass forgets candidates past these. */
+#define MERGE_CANDIDATES 1024
+
+/*! A page seen this pass, which may have the same contents as a later one. */
+struct merge_candidate {
+	uint64_t hash;
+	vaddr_t vaddr;
+};
+
+kevent_t vmp_merge_event;
+
+/*! Merged pages, by hash of their contents. */
+static LIST_HEAD(, vmp_forkpage) merge_index[MERGE_BUCKETS];
+static kspinlock_t merge_lock = KSPINLOCK_INITIALISER;
+static struct merge_candidate candidates[MERGE_CANDIDATES];
+static size_t ncandidates;
+
+void
+vm_merge_set_rate(size_t npages, int64_t interval_ns)
+{
+	vmparam.merge_scan_pages = npages;
+	vmparam.merge_scan_ns = interval_ns;
+	ke_event_signal(&vmp_merge_event);
+}
+
+static uint64_t
+page_hash(vm_page_t *page)
+{
+	const uint64_t *words = (uint64_t *)vm_page_direct_map_addr(page);
+	uint64_t hash = 0xcbf29ce484222325;
+
+	for (size_t i = 0; i < PGSIZE / sizeof(uint64_t); i++) {
+		hash ^= words[i];
+		hash *= 0x100000001b3;
+		hash ^= hash >> 29;
+	}
+
+	return hash;
+}
+
+static bool
+page_same(vm_page_t *x, vm_page_t *y)
+{
+	return memcmp((void *)vm_page_direct_map_addr(x),
+		   (void *)vm_page_direct_map_addr(y), PGSIZE) == 0;
+}
+
+static vm_page_t *
+forkpage_page(struct vmp_forkpage *fp)
+{
+	return vmp_pfn_to_page(vmp_pte_hw_pfn(&fp->pte, 1));
+}
+
+/*!
+ * Find a merged page with contents of hash \p hash, and retain it; returns
+ * NULL if there is none. Whether it is still merged must be checked under its
+ * lock.
+ */
+static vm_page_t *
+merge_index_find(uint64_t hash, struct vmp_forkpage **fp_out)
+{
+	struct vmp_forkpage *fp;
+	vm_page_t *frame = NULL;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&merge_lock);
+	LIST_FOREACH (fp, &merge_index[hash % MERGE_BUCKETS], hash_link) {
+		if (fp->hash == hash) {
+			/* indexed pages are mapped, so this doesn't lock it */
+			frame = vmp_page_retain(forkpage_page(fp));
+			*fp_out = fp;
+			break;
+		}
+	}
+	ke_spinlock_release(&merge_lock, ipl);
+
+	return frame;
+}
+
+static void
+merge_index_remove(struct vmp_forkpage *fp)
+{
+	ipl_t ipl = ke_spinlock_acquire(&merge_lock);
+	LIST_REMOVE(fp, hash_link);
+	ke_spinlock_release(&merge_lock, ipl);
+}
+
+/*!
+ * Get the private page mapped at \p vaddr if it may be merged: its mapping is
+ * valid and it has no reference but the working set's. The PTE is made
+ * read-only so that its contents hold still while it is compared.
+ */
+static vm_page_t *
+page_mergeable(eprocess_t *ps, vaddr_t vaddr, pte_t **pte_out)
+    LOCK_REQUIRES(ps->ws_lock)
+{
+	vm_page_t *page;
+	pte_t *pte;
+
+	if (vmp_fetch_pte(ps, vaddr, &pte) != 0 ||
+	    vmp_pte_characterise(pte) != kPTEKindValid)
+		return NULL;
+
+	page = vmp_pte_hw_page(pte, 1);
+	/* only the WS lock holder retains a mapped page, so this holds */
+	if (page->use != kPageUseAnonPrivate || vmp_page_refcnt(page) != 1)
+		return NULL;
+
+	if (vmp_pte_hw_is_writeable(pte)) {
+		/* a writeable PTE is how a written page is told; keep that */
+		vmp_page_lock(page);
+		page->dirty = true;
+		vmp_page_unlock(page);
+		/* the TLB entry would be flushed here */
+		vmp_pte_hw_create(pte, page->pfn, false);
+	}
+
+	*pte_out = pte;
+	return page;
+}
+
+/*!
+ * Map the merged page \p frame, already retained for the mapping, at \p pte in
+ * place of \p page, which is freed.
+ */
+static void
+merge_into(eprocess_t *ps, vaddr_t vaddr, pte_t *pte, vm_page_t *page,
+    vm_page_t *frame) LOCK_REQUIRES(ps->ws_lock)
+{
+	vm_page_cold_t *cold = vmp_page_cold(page);
+
+	vmp_pte_hw_create(pte, frame->pfn, false);
+	vmp_wsl_lock_entry(ps, vaddr);
+
+	vmp_page_lock(page);
+	vmp_drumslot_free(cold->drumslot);
+	cold->drumslot = -1;
+	cold->referent_pte = 0;
+	vmp_page_set_use(page, kPageUseDeleted);
+	vmp_page_unlock(page);
+	vmp_page_release(page);
+
+	vmp_stat_adjust(vmp_page_node(frame), nmerged, 1);
+}
+
+/*!
+ * Try to merge \p page into the merged page \p frame (retained by the caller,
+ * which passes its reference on) found for it in the index.
+ */
+static bool
+merge_with_frame(eprocess_t *ps, vaddr_t vaddr, pte_t *pte, vm_page_t *page,
+    vm_page_t *frame, struct vmp_forkpage *fp) LOCK_REQUIRES(ps->ws_lock)
+{
+	vmp_page_lock(frame);
+	if (frame->use != kPageUseForkPage ||
+	    vmp_page_cold(frame)->forkpage != fp || !page_same(page, frame)) {
+		vmp_page_unlock(frame);
+		vmp_page_release(frame);
+		return false;
+	}
+	fp->refcount++;
+	vmp_page_unlock(frame);
+
+	merge_into(ps, vaddr, pte, page, frame);
+
+	return true;
+}
+
+/*!
+ * Turn the private page \p page, mapped at \p pte, into a merged page and put
+ * it in the index. Its mapping keeps its reference.
+ */
+static void
+frame_create(eprocess_t *ps, vaddr_t vaddr, pte_t *pte, vm_page_t *page,
+    uint64_t hash) LOCK_REQUIRES(ps->ws_lock)
+{
+	struct vmp_forkpage *fp = kmem_alloc(sizeof(*fp));
+	vm_page_cold_t *cold = vmp_page_cold(page);
+	ipl_t ipl;
+
+	fp->pte = *pte;
+	fp->refcount = 1;
+	fp->hash = hash;
+
+	vmp_page_lock(page);
+	vmp_drumslot_free(cold->drumslot);
+	cold->drumslot = -1;
+	cold->referent_pte = 0;
+	cold->forkpage = fp;
+	page->dirty = false;
+	vmp_page_set_use(page, kPageUseForkPage);
+	vmp_page_unlock(page);
+
+	vmp_wsl_lock_entry(ps, vaddr);
+
+	ipl = ke_spinlock_acquire(&merge_lock);
+	LIST_INSERT_HEAD(&merge_index[hash % MERGE_BUCKETS], fp, hash_link);
+	ke_spinlock_release(&merge_lock, ipl);
+
+	vmp_stat_adjust(vmp_page_node(page), nmerged, 1);
+}
+
+/*!
+ * Try to merge \p page, of hash \p hash, with a candidate seen earlier in the
+ * pass. Returns false, having done nothing, if there is none it matches.
+ */
+static bool
+merge_with_candidate(eprocess_t *ps, vaddr_t vaddr, pte_t *pte,
+    vm_page_t *page, uint64_t hash) LOCK_REQUIRES(ps->ws_lock)
+{
+	for (size_t i = 0; i < ncandidates; i++) {
+		vm_page_t *other;
+		pte_t *other_pte;
+
+		if (candidates[i].hash != hash)
+			continue;
+
+		other = page_mergeable(ps, candidates[i].vaddr, &other_pte);
+		if (other == NULL || other == page || !page_same(page, other))
+			continue;
+
+		frame_create(ps, candidates[i].vaddr, other_pte, other, hash);
+		candidates[i] = candidates[--ncandidates];
+
+		/* and map it here too */
+		vmp_page_lock(other);
+		vmp_page_retain_locked(other);
+		vmp_page_cold(other)->forkpage->refcount++;
+		vmp_page_unlock(other);
+		merge_into(ps, vaddr, pte, page, other);
+
+		return true;
+	}
+
+	return false;
+}
+
+/*! Look at the page mapped at \p vaddr, merging it if it can be. */
+static void
+merge_scan_page(eprocess_t *ps, vaddr_t vaddr) LOCK_REQUIRES(ps->ws_lock)
+{
+	struct vmp_forkpage *fp;
+	vm_page_t *page, *frame;
+	pte_t *pte;
+	uint64_t hash;
+
+	vmp_stat_adjust(&vmp_nodes[vmp_current_node()], nmerge_scanned, 1);
+
+	page = page_mergeable(ps, vaddr, &pte);
+	if (page == NULL)
+		return;
+
+	hash = page_hash(page);
+
+	frame = merge_index_find(hash, &fp);
+	if (frame != NULL && merge_with_frame(ps, vaddr, pte, page, frame, fp))
+		return;
+
+	if (merge_with_candidate(ps, vaddr, pte, page, hash))
+		return;
+
+	if (ncandidates < MERGE_CANDIDATES) {
+		candidates[ncandidates].hash = hash;
+		candidates[ncandidates].vaddr = vaddr;
+		ncandidates++;
+	}
+}
+
+int
+vmp_merge_break(eprocess_t *ps, vm_vad_t *vad, vaddr_t vaddr, pte_t *pte,
+    vm_page_t **page_out)
+{
+	vm_page_t *frame = vmp_pte_hw_page(pte, 1), *page;
+	vm_page_cold_t *cold;
+	struct vmp_forkpage *fp;
+	int r;
+
+	vmp_page_lock(frame);
+	fp = vmp_page_cold(frame)->forkpage;
+	if (fp->refcount == 1) {
+		/* no other mapping shares it, so this one can have it back */
+		merge_index_remove(fp);
+		cold = vmp_page_cold(frame);
+		cold->process = ps;
+		cold->referent_pte = V2P(pte);
+		vmp_page_set_use(frame, kPageUseAnonPrivate);
+		vmp_page_unlock(frame);
+		kmem_free(fp, sizeof(*fp));
+		page = frame;
+	} else {
+		vmp_page_unlock(frame);
+
+		r = vmp_page_alloc_node(&page, vmp_vad_node(vad, vaddr),
+		    kPageUseAnonPrivate, false);
+		if (r != 0)
+			return r;
+
+		vmp_page_copy(page, frame, false);
+		cold = vmp_page_cold(page);
+		cold->process = ps;
+		cold->referent_pte = V2P(pte);
+
+		/* the other mappings may have gone meanwhile */
+		vmp_page_lock(frame);
+		if (--fp->refcount == 0) {
+			merge_index_remove(fp);
+			vmp_page_set_use(frame, kPageUseDeleted);
+			kmem_free(fp, sizeof(*fp));
+		}
+		vmp_page_unlock(frame);
+		vmp_page_release(frame);
+	}
+
+	vmp_pte_hw_create(pte, page->pfn, true);
+	vmp_wsl_unlock_entry(ps, vaddr);
+	vmp_stat_adjust(vmp_page_node(page), nunmerged, 1);
+
+	*page_out = page;
+	return 0;
+}
+
+void *
+vmp_merger(void *)
+{
+	eprocess_t *ps = &kernel_ps;
+	vaddr_t cursor = 0;
+
+loop:
+	ke_event_wait(&vmp_merge_event, vmparam.merge_scan_ns);
+	ke_event_clear(&vmp_merge_event);
+
+	if (vmparam.merge_scan_pages == 0)
+		goto loop;
+
+	ke_wait(&ps->ws_lock, "vmp_merger:ps->ws_lock", false, false, -1);
+
+	for (size_t i = 0; i < vmparam.merge_scan_pages; i++) {
+		if (vmp_wsl_next(ps, &cursor) != 0) {
+			/* start a new pass, with new candidates */
+			cursor = 0;
+			ncandidates = 0;
+			if (vmp_wsl_next(ps, &cursor) != 0)
+				break;
+		}
+
+		if (ps->wsl.nlocked * 2 >= ps->wsl.max)
+			break;
+
+		merge_scan_page(ps, cursor);
+		cursor += PGSIZE;
+	}
+
+	ke_mutex_release(&ps->ws_lock);
+
+	goto loop;
+}
@@ -0,0 +1,362 @@
+/*!
+ * @file migrate.c
+ * @brief Moving pages in use to other physical pages.
+ *
+ * Anonymous private pages mapped by small PTEs can be moved, and so can the
+ * leaf page tables mapping them. The working set list names pages by virtual
+ * address, and the table holding a page's PTE keeps the same counts, so only
+ * the PTE and the PFN database entries change for a page; a table's working set
+ * list entry is renamed, and its directory PTE and the pages it maps follow it.
+ *
+ * The caller says where to by a function that gives a free page straight from
+ * the buddy allocator; it may be on another node, in which case the node page
+ * counts are moved across with the page.
+ */
+
+#include <kdk/executive.h>
+#include <kdk/libkern.h>
+#include <kdk/nanokern.h>
+
+#include "vmp.h"
+
+/*! Give back a page got from a destination function but not used. */
+static void
+dest_return(vm_page_t *page)
+{
+	struct vmp_node *node = vmp_page_node(page);
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&node->free_lock);
+	vmp_buddy_free(page, 0);
+	ke_spinlock_release(&node->free_lock, ipl);
+}
+
+/*!
+ * Free \p page, which \p dst has replaced. The new page takes the old one's
+ * place in the node page counts; if it is on another node, a free page, and
+ * an active page if \p active, move from one node's counts to the other's.
+ */
+static void
+src_release(vm_page_t *page, vm_page_t *dst, bool active)
+{
+	struct vmp_node *node = vmp_page_node(page),
+			*dst_node = vmp_page_node(dst);
+
+	dest_return(page);
+
+	if (dst_node != node) {
+		vmp_stat_adjust(dst_node, nfree, -1);
+		vmp_stat_adjust(node, nfree, 1);
+		if (active) {
+			vmp_stat_adjust(dst_node, nactive, 1);
+			vmp_stat_adjust(node, nactive, -1);
+		}
+	}
+}
+
+/*! Put \p dst in the place of the inactive page \p page on its queue. */
+static void
+queue_replace(struct vmp_node *node, vm_page_t *page, vm_page_t *dst)
+    LOCK_REQUIRES(page) LOCK_REQUIRES(dst)
+{
+	ipl_t ipl;
+
+	if (page->dirty) {
+		ipl = ke_spinlock_acquire(&node->modified_lock);
+		vmp_pgq_replace(&node->modified_pgq, page, dst);
+		ke_spinlock_release(&node->modified_lock, ipl);
+	} else {
+		ipl = ke_spinlock_acquire(&node->standby_lock);
+		vmp_pgq_replace(&node->standby_pgq[page->standby_priority],
+		    page, dst);
+		ke_spinlock_release(&node->standby_lock, ipl);
+	}
+}
+
+/*!
+ * Move an anonymous page into a free page got from \p dest. Returns 0 if the
+ * page was moved, 1 if it can't be just now (it is wired, being paged or part
+ * of a large page), and -1 if \p dest gave no page.
+ *
+ * A page mapped by a valid PTE is moved with its process' WS lock held, which
+ * is what keeps that PTE from changing; the lock of an inactive page guards
+ * its transition PTE and its place on the standby or modified queue, which the
+ * new page takes over so as not to disturb the order pages are reused in.
+ */
+static int
+migrate_anon(eprocess_t *ps, vm_page_t *page, vmp_migrate_dest_t dest,
+    void *arg) LOCK_REQUIRES(ps->ws_lock)
+{
+	struct vmp_node *node = vmp_page_node(page);
+	vm_page_cold_t *cold = vmp_page_cold(page), *dst_cold;
+	vm_page_t *dst;
+	pte_t *pte;
+	bool active, writeable = false;
+	int r = 1;
+
+	/* it may have been freed since vmp_migrate_page() looked */
+	if (!vmp_page_trylock(page))
+		return 1;
+
+	if (page->use != kPageUseAnonPrivate || cold->process != ps ||
+	    cold->referent_pte == 0)
+		goto out;
+
+	/* the pages of a large page are mapped from a PML2 table */
+	if (vmp_paddr_to_page((cold->referent_pte / PGSIZE) * PGSIZE)->use !=
+	    kPageUsePML1)
+		goto out;
+
+	pte = (pte_t *)P2V(cold->referent_pte);
+	if (vmp_page_refcnt(page) == 1 &&
+	    vmp_pte_characterise(pte) == kPTEKindValid &&
+	    vmp_pte_hw_pfn(pte, 1) == page->pfn)
+		active = true;
+	else if (vmp_page_refcnt(page) == 0 &&
+	    vmp_pte_characterise(pte) == kPTEKindTrans &&
+	    pte->trans.pfn == page->pfn)
+		active = false;
+	else
+		goto out;
+
+	dst = dest(arg);
+	if (dst == NULL) {
+		r = -1;
+		goto out;
+	}
+
+	/* the standby and modified queues are per node */
+	if (!active && vmp_page_node(dst) != node) {
+		dest_return(dst);
+		goto out;
+	}
+
+	/* nothing else but a migrator trying its lock can find it yet */
+	vmp_page_lock(dst);
+
+	if (active) {
+		/*
+		 * unmap the page while it is copied, so it can't be written
+		 * meanwhile (TLBs would be shot down here.) a fault on it waits
+		 * for the WS lock, by when it is mapped again.
+		 */
+		writeable = vmp_pte_hw_is_writeable(pte);
+		vmp_pte_trans_create(pte, page->pfn);
+	}
+
+	/* the migrator won't touch the copy again, so keep it out of cache */
+	vmp_page_copy(dst, page, true);
+
+	dst_cold = vmp_page_cold(dst);
+	kassert(vmp_page_refcnt(dst) == 0 && dst_cold->referent_pte == 0);
+	dst_cold->process = ps;
+	dst_cold->referent_pte = cold->referent_pte;
+	dst_cold->drumslot = cold->drumslot;
+	dst->dirty = page->dirty;
+	dst_cold->reused = cold->reused;
+	dst->standby_priority = page->standby_priority;
+	vmp_page_set_use(dst, kPageUseAnonPrivate);
+
+	if (active) {
+		/* the working set's reference moves to the new page */
+		atomic_fetch_add_explicit(&dst->refcnt, 1,
+		    memory_order_relaxed);
+		atomic_fetch_sub_explicit(&page->refcnt, 1,
+		    memory_order_relaxed);
+		vmp_pte_hw_create(pte, dst->pfn, writeable);
+	} else {
+		queue_replace(node, page, dst);
+		vmp_pte_trans_create(pte, dst->pfn);
+	}
+
+	vmp_page_unlock(dst);
+
+	cold->referent_pte = 0;
+	cold->drumslot = -1;
+	page->dirty = false;
+	cold->reused = false;
+	vmp_page_set_use(page, kPageUseFree);
+	vmp_page_unlock(page);
+
+	src_release(page, dst, active);
+
+	return 0;
+
+out:
+	vmp_page_unlock(page);
+	return r;
+}
+
+/*!
+ * Move a leaf page table, as migrate_anon() does a page. The pages it maps are
+ * pointed at the new copy, the directory PTE and working set list entry follow
+ * it, and all its references pass to the new page.
+ *
+ * The WS lock keeps the table itself, and the valid PTEs in it, from changing.
+ * Inactive pages it maps may be stolen without the WS lock, though, which
+ * makes their PTE swap and then (taking the table's lock) updates the table's
+ * counts; so the locks of those pages are held too, and a steal caught between
+ * the two steps is told by the count of nonswap PTEs not agreeing with the
+ * entries. A table with a busy PTE stays put: a pagein holds its address.
+ */
+static int
+migrate_table(eprocess_t *ps, vm_page_t *table, vmp_migrate_dest_t dest,
+    void *arg) LOCK_REQUIRES(ps->ws_lock)
+{
+	vm_page_cold_t *cold = vmp_page_cold(table), *dst_cold;
+	pte_t *ptes = (pte_t *)P2V(vmp_page_paddr(table)), *dst_ptes, *dirpte;
+	vm_page_t *locked[VMP_LEVEL_1_ENTRIES], *dst;
+	size_t nlocked = 0, nonswap = 0;
+	bool writeable;
+	int r = 1;
+
+	/* tables are only made and deleted under the WS lock */
+	if (table->use != kPageUsePML1 || cold->process != ps)
+		return 1;
+
+	/* never wait for a page lock while holding others */
+	for (size_t i = 0; i < VMP_LEVEL_1_ENTRIES; i++) {
+		vm_page_t *page;
+
+		switch (vmp_pte_characterise(&ptes[i])) {
+		case kPTEKindValid:
+			nonswap++;
+			break;
+
+		case kPTEKindTrans:
+			page = vmp_pte_trans_page(&ptes[i]);
+			if (!vmp_page_trylock(page))
+				goto out;
+			locked[nlocked++] = page;
+			if (vmp_pte_characterise(&ptes[i]) != kPTEKindTrans ||
+			    ptes[i].trans.pfn != page->pfn)
+				goto out;
+			nonswap++;
+			break;
+
+		case kPTEKindBusy:
+			goto out;
+
+		default:
+			break;
+		}
+	}
+
+	if (!vmp_page_trylock(table))
+		goto out;
+
+	dirpte = (pte_t *)P2V(cold->referent_pte);
+	if (cold->nonswap_ptes != nonswap ||
+	    vmp_page_refcnt(table) != nonswap + 1 ||
+	    vmp_pte_characterise(dirpte) != kPTEKindValid ||
+	    vmp_pte_hw_pfn(dirpte, 2) != table->pfn)
+		goto out_unlock_table;
+
+	dst = dest(arg);
+	if (dst == NULL) {
+		r = -1;
+		goto out_unlock_table;
+	}
+
+	/* as for a page, unmap the table while it is copied */
+	writeable = vmp_pte_hw_is_writeable(dirpte);
+	vmp_pte_trans_create(dirpte, table->pfn);
+
+	dst_ptes = (pte_t *)P2V(vmp_page_paddr(dst));
+	vmp_page_copy(dst, table, false);
+
+	for (size_t i = 0; i < VMP_LEVEL_1_ENTRIES; i++) {
+		switch (vmp_pte_characterise(&dst_ptes[i])) {
+		case kPTEKindValid:
+			/* a merged page or the zero page has no one referent */
+			if (vmp_pte_hw_page(&dst_ptes[i], 1)->use ==
+				kPageUseForkPage ||
+			    vmp_pte_hw_page(&dst_ptes[i], 1) == vmp_zero_page)
+				break;
+			vmp_page_cold(vmp_pte_hw_page(&dst_ptes[i], 1))
+			    ->referent_pte = V2P(&dst_ptes[i]);
+			break;
+
+		case kPTEKindTrans:
+			vmp_page_cold(vmp_pte_trans_page(&dst_ptes[i]))
+			    ->referent_pte = V2P(&dst_ptes[i]);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	/* the new table is found by nothing but the WS lock holder yet */
+	dst_cold = vmp_page_cold(dst);
+	kassert(vmp_page_refcnt(dst) == 0 && dst_cold->nonzero_ptes == 0);
+	dst_cold->process = ps;
+	dst_cold->referent_pte = cold->referent_pte;
+	dst_cold->nonzero_ptes = cold->nonzero_ptes;
+	dst_cold->nonswap_ptes = cold->nonswap_ptes;
+	dst_cold->drumslot = cold->drumslot;
+	vmp_page_set_use(dst, kPageUsePML1);
+	atomic_fetch_add_explicit(&dst->refcnt, nonswap + 1,
+	    memory_order_relaxed);
+	atomic_fetch_sub_explicit(&table->refcnt, nonswap + 1,
+	    memory_order_relaxed);
+
+	vmp_wsl_rename(ps, P2V(vmp_page_paddr(table)),
+	    P2V(vmp_page_paddr(dst)));
+	vmp_pte_hw_create(dirpte, dst->pfn, writeable);
+
+	cold->referent_pte = 0;
+	cold->nonzero_ptes = 0;
+	cold->nonswap_ptes = 0;
+	cold->drumslot = -1;
+	vmp_page_set_use(table, kPageUseFree);
+	vmp_page_unlock(table);
+
+	src_release(table, dst, true);
+
+	r = 0;
+	goto out;
+
+out_unlock_table:
+	vmp_page_unlock(table);
+out:
+	while (nlocked > 0)
+		vmp_page_unlock(locked[--nlocked]);
+	return r;
+}
+
+int
+vmp_migrate_page(vm_page_t *page, vmp_migrate_dest_t dest, void *arg)
+{
+	eprocess_t *ps;
+	bool is_table;
+	int r;
+
+	/*
+	 * Nothing keeps the page from being freed and allocated again, so its
+	 * lock may only be tried; and pages on the buddy lists are let be.
+	 */
+	if (page->use == kPageUseFree || !vmp_page_trylock(page))
+		return 1;
+	is_table = page->use == kPageUsePML1;
+	ps = page->use == kPageUseAnonPrivate || is_table ?
+	    vmp_page_cold(page)->process :
+	    NULL;
+	vmp_page_unlock(page);
+	if (ps == NULL)
+		return 1;
+
+	/* the WS lock comes before page locks, so can only be tried for here */
+	if (ke_wait(&ps->ws_lock, "vmp_migrate_page:ps->ws_lock", false, false,
+		0) != kKernWaitStatusOK)
+		return 1;
+
+	if (is_table)
+		r = migrate_table(ps, page, dest, arg);
+	else
+		r = migrate_anon(ps, page, dest, arg);
+
+	ke_mutex_release(&ps->ws_lock);
+
+	return r;
+}
@@ -0,0 +1,360 @@
+/*!
+ * @file pageops.c
+ * @brief Kernels to zero, copy and test whole pages, picked for the CPU at
+ * startup.
+ *
+ * There is a set of kernels for each instruction set (see vmp_page_kernels[]).
+ * Pages can be stored to through the cache, for a page about to be used by the
+ * thread at hand, or with non-temporal stores, which go around it: the zeroer
+ * clears pages that may not be allocated for some time, and a migrated page is
+ * copied by a thread that won't touch it again, so filling the cache with their
+ * lines would only push out lines that are wanted.
+ *
+ * Cached stores are always libc's memset() and memcpy(), which are built
+ * optimised whatever this tree is built as; the vector sets' own were slower
+ * in the default build, and about even in an optimised one. For non-temporal
+ * stores, which libc hasn't got, and for zero tests the widest set the CPU
+ * supports is used. SIM_page_kernels_bench() compares the sets. The libc set
+ * is the only one off x86-64, and there non-temporal stores are cached ones.
+ */
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <string.h>
+
+#include "vmp.h"
+
+#define PAGE_WORDS (PGSIZE / sizeof(uint64_t))
+
+static void
+libc_zero(void *page)
+{
+	memset(page, 0x0, PGSIZE);
+}
+
+static void
+libc_copy(void *dst, const void *src)
+{
+	memcpy(dst, src, PGSIZE);
+}
+
+/*!
+ * The words of each cache line are ORed together before testing, which lets
+ * the compiler use what vector instructions it may; most pages that aren't
+ * zero are told by their first line.
+ */
+static bool
+libc_is_zero(const void *page)
+{
+	const uint64_t *words = page;
+
+	for (size_t i = 0; i < PAGE_WORDS; i += 8) {
+		uint64_t acc = 0;
+
+		for (size_t j = 0; j < 8; j++)
+			acc |= words[i + j];
+		if (acc != 0)
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+libc_supported(void)
+{
+	return true;
+}
+
+#if defined(__x86_64__)
+
+static void
+sse2_zero(void *page)
+{
+	__m128i *p = page, zero = _mm_setzero_si128();
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m128i); i += 4) {
+		_mm_store_si128(&p[i], zero);
+		_mm_store_si128(&p[i + 1], zero);
+		_mm_store_si128(&p[i + 2], zero);
+		_mm_store_si128(&p[i + 3], zero);
+	}
+}
+
+static void
+sse2_zero_nt(void *page)
+{
+	__m128i *p = page, zero = _mm_setzero_si128();
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m128i); i += 4) {
+		_mm_stream_si128(&p[i], zero);
+		_mm_stream_si128(&p[i + 1], zero);
+		_mm_stream_si128(&p[i + 2], zero);
+		_mm_stream_si128(&p[i + 3], zero);
+	}
+	/* order the streaming stores before whatever publishes the page */
+	_mm_sfence();
+}
+
+static void
+sse2_copy(void *dst, const void *src)
+{
+	__m128i *d = dst;
+	const __m128i *s = src;
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m128i); i += 4) {
+		__m128i a = _mm_load_si128(&s[i]), b = _mm_load_si128(&s[i + 1]),
+			c = _mm_load_si128(&s[i + 2]),
+			e = _mm_load_si128(&s[i + 3]);
+		_mm_store_si128(&d[i], a);
+		_mm_store_si128(&d[i + 1], b);
+		_mm_store_si128(&d[i + 2], c);
+		_mm_store_si128(&d[i + 3], e);
+	}
+}
+
+static void
+sse2_copy_nt(void *dst, const void *src)
+{
+	__m128i *d = dst;
+	const __m128i *s = src;
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m128i); i += 4) {
+		__m128i a = _mm_load_si128(&s[i]), b = _mm_load_si128(&s[i + 1]),
+			c = _mm_load_si128(&s[i + 2]),
+			e = _mm_load_si128(&s[i + 3]);
+		_mm_stream_si128(&d[i], a);
+		_mm_stream_si128(&d[i + 1], b);
+		_mm_stream_si128(&d[i + 2], c);
+		_mm_stream_si128(&d[i + 3], e);
+	}
+	_mm_sfence();
+}
+
+static bool
+sse2_is_zero(const void *page)
+{
+	const __m128i *p = page;
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m128i); i += 4) {
+		__m128i acc = _mm_or_si128(
+		    _mm_or_si128(_mm_load_si128(&p[i]),
+			_mm_load_si128(&p[i + 1])),
+		    _mm_or_si128(_mm_load_si128(&p[i + 2]),
+			_mm_load_si128(&p[i + 3])));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc,
+			_mm_setzero_si128())) != 0xffff)
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+sse2_supported(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("avx2"))) static void
+avx2_zero(void *page)
+{
+	__m256i *p = page, zero = _mm256_setzero_si256();
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m256i); i += 2) {
+		_mm256_store_si256(&p[i], zero);
+		_mm256_store_si256(&p[i + 1], zero);
+	}
+}
+
+__attribute__((target("avx2"))) static void
+avx2_zero_nt(void *page)
+{
+	__m256i *p = page, zero = _mm256_setzero_si256();
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m256i); i += 2) {
+		_mm256_stream_si256(&p[i], zero);
+		_mm256_stream_si256(&p[i + 1], zero);
+	}
+	_mm_sfence();
+}
+
+__attribute__((target("avx2"))) static void
+avx2_copy(void *dst, const void *src)
+{
+	__m256i *d = dst;
+	const __m256i *s = src;
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m256i); i += 2) {
+		__m256i a = _mm256_load_si256(&s[i]),
+			b = _mm256_load_si256(&s[i + 1]);
+		_mm256_store_si256(&d[i], a);
+		_mm256_store_si256(&d[i + 1], b);
+	}
+}
+
+__attribute__((target("avx2"))) static void
+avx2_copy_nt(void *dst, const void *src)
+{
+	__m256i *d = dst;
+	const __m256i *s = src;
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m256i); i += 2) {
+		__m256i a = _mm256_load_si256(&s[i]),
+			b = _mm256_load_si256(&s[i + 1]);
+		_mm256_stream_si256(&d[i], a);
+		_mm256_stream_si256(&d[i + 1], b);
+	}
+	_mm_sfence();
+}
+
+__attribute__((target("avx2"))) static bool
+avx2_is_zero(const void *page)
+{
+	const __m256i *p = page;
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m256i); i += 2) {
+		__m256i acc = _mm256_or_si256(_mm256_load_si256(&p[i]),
+		    _mm256_load_si256(&p[i + 1]));
+		if (!_mm256_testz_si256(acc, acc))
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx512f"))) static void
+avx512_zero(void *page)
+{
+	__m512i *p = page, zero = _mm512_setzero_si512();
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m512i); i++)
+		_mm512_store_si512(&p[i], zero);
+}
+
+__attribute__((target("avx512f"))) static void
+avx512_zero_nt(void *page)
+{
+	__m512i *p = page, zero = _mm512_setzero_si512();
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m512i); i++)
+		_mm512_stream_si512(&p[i], zero);
+	_mm_sfence();
+}
+
+__attribute__((target("avx512f"))) static void
+avx512_copy(void *dst, const void *src)
+{
+	__m512i *d = dst;
+	const __m512i *s = src;
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m512i); i++)
+		_mm512_store_si512(&d[i], _mm512_load_si512(&s[i]));
+}
+
+__attribute__((target("avx512f"))) static void
+avx512_copy_nt(void *dst, const void *src)
+{
+	__m512i *d = dst;
+	const __m512i *s = src;
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m512i); i++)
+		_mm512_stream_si512(&d[i], _mm512_load_si512(&s[i]));
+	_mm_sfence();
+}
+
+__attribute__((target("avx512f"))) static bool
+avx512_is_zero(const void *page)
+{
+	const __m512i *p = page;
+
+	for (size_t i = 0; i < PGSIZE / sizeof(__m512i); i += 2) {
+		__m512i acc = _mm512_or_si512(_mm512_load_si512(&p[i]),
+		    _mm512_load_si512(&p[i + 1]));
+		if (_mm512_test_epi64_mask(acc, acc) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+avx512_supported(void)
+{
+	return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+/*! From narrowest to widest; the last the CPU supports is used. */
+const struct vmp_page_kernels vmp_page_kernels[] = {
+	{ "libc", libc_supported, libc_zero, NULL, libc_copy, NULL,
+	    libc_is_zero },
+#if defined(__x86_64__)
+	{ "sse2", sse2_supported, sse2_zero, sse2_zero_nt, sse2_copy,
+	    sse2_copy_nt, sse2_is_zero },
+	{ "avx2", avx2_supported, avx2_zero, avx2_zero_nt, avx2_copy,
+	    avx2_copy_nt, avx2_is_zero },
+	{ "avx512", avx512_supported, avx512_zero, avx512_zero_nt, avx512_copy,
+	    avx512_copy_nt, avx512_is_zero },
+#endif
+};
+const size_t vmp_npage_kernels = sizeof(vmp_page_kernels) /
+    sizeof(vmp_page_kernels[0]);
+
+/*!
+ * The kernels for non-temporal stores and zero tests; libc's, so falling back
+ * to cached stores, until vmp_page_kernels_init() picks.
+ */
+static const struct vmp_page_kernels *kernels = &vmp_page_kernels[0];
+
+void
+vmp_page_kernels_init(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+#endif
+
+	for (size_t i = 0; i < vmp_npage_kernels; i++)
+		if (vmp_page_kernels[i].supported())
+			kernels = &vmp_page_kernels[i];
+
+	kprintf("Page kernels: libc cached stores, %s non-temporal stores "
+		"and zero tests\n",
+	    kernels->name);
+}
+
+void
+vmp_page_zero(vm_page_t *page, bool nontemporal)
+{
+	void *addr = (void *)vm_page_direct_map_addr(page);
+
+	if (nontemporal && kernels->zero_nt != NULL)
+		kernels->zero_nt(addr);
+	else
+		libc_zero(addr);
+}
+
+void
+vmp_page_copy(vm_page_t *dst, vm_page_t *src, bool nontemporal)
+{
+	void *to = (void *)vm_page_direct_map_addr(dst);
+	const void *from = (void *)vm_page_direct_map_addr(src);
+
+	if (nontemporal && kernels->copy_nt != NULL)
+		kernels->copy_nt(to, from);
+	else
+		libc_copy(to, from);
+}
+
+bool
+vmp_page_is_zero(vm_page_t *page)
+{
+	return kernels->is_zero((void *)vm_page_direct_map_addr(page));
+}
@@ -5,6 +5,7 @@
 
 #include <sys/param.h>
 
+#include <kdk/executive.h>
 #include <kdk/io.h>
 #include <kdk/libkern.h>
 #include <kdk/nanokern.h>
@@ -26,6 +27,7 @@ init_vmp_pagefile(vmp_pagefile_t *pf, vnode_t *vnode, size_t length)
 	if (!pf || !vnode)
 		return -1;
 
+	ke_spinlock_init(&pf->lock);
 	pf->vnode = vnode;
 	pf->total_slots = length / PGSIZE;
 	pf->free_slots = pf->total_slots;
@@ -45,9 +47,17 @@ init_vmp_pagefile(vmp_pagefile_t *pf, vnode_t *vnode, size_t length)
 uintptr_t
 vmp_pagefile_alloc(vmp_pagefile_t *pf)
 {
-	if (!pf || pf->free_slots == 0)
+	ipl_t ipl;
+
+	if (!pf)
 		return -1;
 
+	ipl = ke_spinlock_acquire(&pf->lock);
+	if (pf->free_slots == 0) {
+		ke_spinlock_release(&pf->lock, ipl);
+		return -1;
+	}
+
 	size_t start = pf->next_free;
 	for (size_t i = 0; i < pf->total_slots; ++i) {
 		size_t idx = (start + i) % pf->total_slots;
@@ -59,13 +69,32 @@ vmp_pagefile_alloc(vmp_pagefile_t *pf)
 			pf->free_slots--;
 
 			pf->next_free = (idx + 1) % pf->total_slots;
+			ke_spinlock_release(&pf->lock, ipl);
 			return idx;
 		}
 	}
 
+	ke_spinlock_release(&pf->lock, ipl);
 	return -1;
 }
 
+void
+vmp_pagefile_free(vmp_pagefile_t *pf, uintptr_t slot)
+{
+	ipl_t ipl;
+
+	if (slot == -1)
+		return;
+
+	kassert(slot < pf->total_slots);
+
+	ipl = ke_spinlock_acquire(&pf->lock);
+	kassert(pf->bitmap[slot / 8] & (1 << (slot % 8)));
+	pf->bitmap[slot / 8] &= ~(1 << (slot % 8));
+	pf->free_slots++;
+	ke_spinlock_release(&pf->lock, ipl);
+}
+
 void
 SIM_paging_init(void)
 {
@@ -77,17 +106,30 @@ SIM_paging_init(void)
 	init_vmp_pagefile(&vmp_pagefile, &vnode, 1024 * 1024);
 }
 
-static void
-cluster_anon(vm_mdl_t *mdl, iop_t *iop, vm_page_t *page)
+/*!
+ * Set up \p iop to write \p page to the pagefile. Returns false, leaving the
+ * page dirty, if the pagefile has no free slot for it.
+ */
+static bool
+cluster_anon(vm_mdl_t *mdl, iop_t *iop, vm_page_t *page) LOCK_REQUIRES(page)
 {
-	pte_t *page_pte = (pte_t*)P2V(page->referent_pte);
+	vm_page_cold_t *cold = vmp_page_cold(page);
+	pte_t *page_pte = (pte_t*)P2V(cold->referent_pte);
 
 	kprintf(" !!! Referent PTE is %p; Position in Kluster: %lu\n", page_pte, ((uintptr_t)page_pte % (16 * sizeof(pte_t))) / sizeof(pte_t));
 
-	if (page->drumslot == -1) {
+	/* the store turned the page away this time, so it goes to disk */
+	if (vmp_drumslot_is_cstore(cold->drumslot)) {
+		vmp_cstore_free(cold->drumslot);
+		cold->drumslot = -1;
+	}
+
+	if (cold->drumslot == -1) {
 		uintptr_t swapdesc;
 		swapdesc = vmp_pagefile_alloc(&vmp_pagefile);
-		page->drumslot = swapdesc;
+		if (swapdesc == -1)
+			return false;
+		cold->drumslot = swapdesc;
 	}
 
 	mdl->offset = 0;
@@ -96,15 +138,113 @@ cluster_anon(vm_mdl_t *mdl, iop_t *iop, vm_page_t *page)
 
 	kprintf("Paging out %zu\n", (size_t)page->pfn);
 	iop_init_vnode_write(iop, vmp_pagefile.vnode, mdl, PGSIZE,
-	    page->drumslot * PGSIZE);
+	    cold->drumslot * PGSIZE);
+
+	page->dirty = false;
+	vmp_stat_adjust(vmp_page_node(page), npageout, 1);
+
+	return true;
+}
+
+/*!
+ * Clean an anonymous page that turned out to be all zeroes by dropping it: its
+ * PTE goes back to demand-zero, so that a fault on it gets a zeroed page, and
+ * its pagefile slot is freed. Returns false, leaving the page be, if it isn't
+ * zero or the process' WS lock is busy.
+ *
+ * The page lock is given up; the page writer's reference frees the page when
+ * dropped.
+ */
+static bool
+drop_zero_page(vm_page_t *page) LOCK_REQUIRES(page)
+{
+	vm_page_cold_t *cold = vmp_page_cold(page);
+	eprocess_t *ps = cold->process;
+	pte_t *pte = (pte_t *)P2V(cold->referent_pte);
+	vm_page_t *table;
+
+	if (!vmp_page_is_zero(page))
+		return false;
+
+	/* the WS lock comes before page locks, so can only be tried for here */
+	if (ke_wait(&ps->ws_lock, "drop_zero_page:ps->ws_lock", false, false,
+		0) != kKernWaitStatusOK)
+		return false;
+
+	/* the lock of an inactive page guards its transition PTE */
+	kassert(vmp_pte_characterise(pte) == kPTEKindTrans &&
+	    pte->trans.pfn == page->pfn);
+	table = vmp_paddr_to_page((cold->referent_pte / PGSIZE) * PGSIZE);
+
+	vmp_pte_zero_create(pte);
+	vmp_drumslot_free(cold->drumslot);
+	cold->drumslot = -1;
+	cold->referent_pte = 0;
+	page->dirty = false;
+	vmp_page_set_use(page, kPageUseDeleted);
+	vmp_stat_adjust(vmp_page_node(page), npageout_zero, 1);
+	vmp_page_unlock(page);
+
+	vmp_pagetable_page_pte_deleted(ps, table, false);
+	ke_mutex_release(&ps->ws_lock);
 
+	return true;
+}
+
+/*!
+ * Clean an anonymous page by compressing it into the compressed store, if it
+ * compresses well enough and there is room. It gives up any older copy.
+ */
+static bool
+clean_cstore(vm_page_t *page) LOCK_REQUIRES(page)
+{
+	vm_page_cold_t *cold = vmp_page_cold(page);
+	uintptr_t handle;
+
+	handle = vmp_cstore_put(page);
+	if (handle == -1)
+		return false;
+
+	vmp_drumslot_free(cold->drumslot);
+	cold->drumslot = handle;
 	page->dirty = false;
+
+	return true;
+}
+
+/*!
+ * Find the next modified page to clean, taking the nodes in turn. The page is
+ * returned locked, so that it can't be taken off the queue under us.
+ */
+static vm_page_t *
+next_modified_page(void)
+{
+	static unsigned next_node;
+
+	for (unsigned i = 0; i < vmp_nnodes; i++) {
+		struct vmp_node *node = &vmp_nodes[next_node];
+		vm_page_t *page;
+		ipl_t ipl;
+
+		next_node = (next_node + 1) % vmp_nnodes;
+
+		/* queue lock is held, so can only trylock pages */
+		ipl = ke_spinlock_acquire(&node->modified_lock);
+		VMP_PGQ_FOREACH (page, &node->modified_pgq)
+			if (vmp_page_trylock(page))
+				break;
+		ke_spinlock_release(&node->modified_lock, ipl);
+
+		if (page != NULL)
+			return page;
+	}
+
+	return NULL;
 }
 
 void *
 vmp_pgwriter(void *)
 {
-	ipl_t ipl;
 	size_t n_to_clean;
 	size_t n_iops;
 	iop_t *iops = kmem_alloc(sizeof(iop_t) * MAX_IOPS);
@@ -121,25 +261,35 @@ loop:
 	ke_event_wait(&vmp_pgwriter_event, NS_PER_S);
 
 	if (vmp_page_shortage())
-		n_to_clean = MAX(32, vmstat.nmodified / 30);
+		n_to_clean = MAX(32, vmp_stat_read(&vmstat, nmodified) / 30);
 	else
-		n_to_clean = MAX(16, vmstat.nmodified / 45);
+		n_to_clean = MAX(16, vmp_stat_read(&vmstat, nmodified) / 45);
 
 	n_iops = 0;
 
 	while (n_to_clean > 0 && n_iops < MAX_IOPS) {
 		vm_page_t *page;
-		ipl = vmp_acquire_pfn_lock();
-		page = TAILQ_FIRST(&modified_pgq);
+		page = next_modified_page();
 		if (page == NULL) {
 			ke_event_clear(&vmp_pgwriter_event);
-			vmp_release_pfn_lock(ipl);
 			break;
 		}
 
 		/* this removes it from the queue */
 		vmp_page_retain_locked(page);
 
+		if (page->use == kPageUseAnonPrivate && drop_zero_page(page)) {
+			vmp_page_release(page);
+			continue;
+		}
+
+		/* no I/O needed; releasing it puts it on the standby queue */
+		if (page->use == kPageUseAnonPrivate && clean_cstore(page)) {
+			vmp_page_release_locked(page);
+			vmp_page_unlock(page);
+			continue;
+		}
+
 		/* TODO(feature): clustered writeback */
 		switch (page->use) {
 		case kPageUseAnonPrivate:
@@ -151,8 +301,15 @@ loop:
 			vm_mdl_t *mdl = mdls[n_iops];
 			iop_t *iop = &iops[n_iops];
 
-			cluster_anon(mdl, iop, page);
-			vmp_release_pfn_lock(ipl);
+			if (!cluster_anon(mdl, iop, page)) {
+				/* back on the modified queue until slots free */
+				vmp_page_release_locked(page);
+				vmp_page_unlock(page);
+				ke_event_clear(&vmp_pgwriter_event);
+				n_to_clean = 0;
+				break;
+			}
+			vmp_page_unlock(page);
 
 			iop_send(iop);
 			n_iops++;
@@ -169,16 +326,15 @@ loop:
 		for (int i = 0; i < n_iops; i++)
 			ke_event_wait(wait_events[i], -1);
 
-		for (int i = 0; i < n_iops; i++)
-			vm_mdl_release_pages(mdls[i]);
+		vm_mdl_release_pages_n(mdls, n_iops);
 	}
 
+	vmp_cstore_writeback();
+
 	/* need test here for few modified pages (go back to slow writeback) */
 #if 0
-	ipl = vmp_acquire_pfn_lock();
 	if (vmp_page_sufficience())
 		ke_event_clear(&vmp_pgwriter_event);
-	vmp_release_pfn_lock(ipl);
 #endif
 
 	goto loop;
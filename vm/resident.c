@@ -1,33 +1,551 @@
+#include <sys/param.h>
+#include <sys/mman.h>
+
 #include <string.h>
 
 #include "soft.h"
 #include "vm.h"
 #include "vm/vmp.h"
 
-bool vmp_was_shortage = false;
-uint8_t SOFT_pages[4096 * SOFT_NPAGES] __attribute__((aligned(PGSIZE)));
-static vm_page_t mypages[SOFT_NPAGES] __attribute__((aligned(PGSIZE)));
-kspinlock_t vmp_pfn_lock = KSPINLOCK_INITIALISER;
+atomic_bool vmp_was_shortage = false;
+uint8_t *SOFT_pages;
+size_t SOFT_npages;
+enum soft_arena_backing SIM_arena_backing = kSoftArenaSmall;
+struct vmp_section *vmp_sections;
+size_t vmp_nsections;
 struct vm_param vmparam;
-struct vm_stat vmstat;
+struct vmp_stat vmstat;
+struct vmp_node vmp_nodes[VMP_MAX_NODES];
+unsigned vmp_nnodes;
+vm_page_t *vmp_zero_page;
+/*! Nodes in the fast tier; they come first, and the slow tier's after. */
+static unsigned nfast_nodes;
+
+/*! Most pages a magazine holds in each of its stacks. */
+#define MAGAZINE_SIZE 32
+/*! Pages moved between a magazine and the global queues at a time. */
+#define MAGAZINE_BATCH 16
+
+/*!
+ * Per-CPU (here, per-thread) cache of free pages from one node, sitting in
+ * front of that node's free queues, so that bursts of allocation and freeing
+ * only touch the node's queues once per batch. Pages in a magazine remain
+ * counted in the node's nzeroed or nfree.
+ *
+ * Each magazine has its own lock. Only its owning thread normally takes it, so
+ * it is uncontended; it exists so that any thread can drain all the magazines
+ * when the node queues run dry. The node's free lock is only taken to move a
+ * batch of pages in or out, never for a single page.
+ */
+struct vmp_magazine {
+	TAILQ_ENTRY(vmp_magazine) link;
+	kspinlock_t lock;
+	struct vmp_node *node;
+	/*! Zeroed pages ready to be allocated. */
+	size_t nzeroed;
+	vm_page_t *zeroed[MAGAZINE_SIZE];
+	/*! Freed pages not yet zeroed; most recently freed (hottest) last. */
+	size_t nfree;
+	vm_page_t *free[MAGAZINE_SIZE];
+};
+
+static TAILQ_HEAD(, vmp_magazine) magazines = TAILQ_HEAD_INITIALIZER(
+    magazines);
+/*! Guards the list of magazines (but not their contents.) */
+static kspinlock_t magazines_lock = KSPINLOCK_INITIALISER;
+static __thread struct vmp_magazine *this_magazines[VMP_MAX_NODES];
+
+/*! Size of a host huge page. */
+#define HOST_HUGE_PAGE_SIZE (2ul * 1024 * 1024)
+
+static const char *arena_backing_names[] = {
+	[kSoftArenaSmall] = "small pages",
+	/* madvise() succeeding doesn't mean the host backs the arena with them */
+	[kSoftArenaTHP] = "small pages, THP requested",
+	[kSoftArenaHugeTLB] = "hugetlb pages",
+};
+
+/*!
+ * Map \p size bytes of zeroed simulated memory, on host huge pages if
+ * SIM_arena_backing asks for them. Hugetlb pages fall back to asking for
+ * transparent huge pages, and that to small pages. The backing got is returned
+ * in \p backing; for THP, only that they were asked for.
+ *
+ * Every P2V() access lands in these arenas, so with small pages a simulation
+ * of any size spends much of its time in host TLB misses.
+ */
+static void *
+sim_arena_alloc(size_t size, enum soft_arena_backing *backing)
+{
+	size_t huge_size = roundup(size, HOST_HUGE_PAGE_SIZE);
+	uintptr_t map, aligned;
+	void *addr;
+
+	if (SIM_arena_backing == kSoftArenaHugeTLB) {
+		/*
+		 * Not MAP_NORESERVE: without a reservation, running out of the
+		 * pool would be a SIGBUS on touch rather than a failure here.
+		 */
+		addr = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (addr != MAP_FAILED) {
+			*backing = kSoftArenaHugeTLB;
+			return addr;
+		}
+	}
+
+	if (SIM_arena_backing != kSoftArenaSmall &&
+	    size >= HOST_HUGE_PAGE_SIZE) {
+		/* map extra so the arena can start on a huge page boundary */
+		addr = mmap(NULL, huge_size + HOST_HUGE_PAGE_SIZE,
+		    PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (addr == MAP_FAILED)
+			kfatal("Failed to map %zu bytes of simulated memory\n",
+			    size);
+
+		map = (uintptr_t)addr;
+		aligned = roundup(map, HOST_HUGE_PAGE_SIZE);
+		if (aligned != map)
+			munmap(addr, aligned - map);
+		munmap((void *)(aligned + huge_size),
+		    map + HOST_HUGE_PAGE_SIZE - aligned);
+
+		if (madvise((void *)aligned, huge_size, MADV_HUGEPAGE) == 0) {
+			*backing = kSoftArenaTHP;
+			return (void *)aligned;
+		}
+		munmap((void *)aligned, huge_size);
+	}
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED)
+		kfatal("Failed to map %zu bytes of simulated memory\n", size);
+	*backing = kSoftArenaSmall;
+	return addr;
+}
+
+struct vmp_node *
+vmp_page_node(vm_page_t *page)
+{
+	return &vmp_nodes[vmp_pfn_section(page->pfn)->node];
+}
+
+/*!
+ * Get the node to try \p i'th (from 0) for an allocation on behalf of node
+ * \p nodeid: the nodes of its own tier, going round from it, and then those of
+ * the other tier.
+ */
+static struct vmp_node *
+node_fallback(unsigned nodeid, unsigned i)
+{
+	unsigned nslow = vmp_nnodes - nfast_nodes;
+
+	if (nodeid < nfast_nodes)
+		return &vmp_nodes[i < nfast_nodes ?
+			(nodeid + i) % nfast_nodes :
+			i];
+	else
+		return &vmp_nodes[i < nslow ?
+			nfast_nodes + (nodeid - nfast_nodes + i) % nslow :
+			i - nslow];
+}
+
+static void
+buddy_insert(struct vmp_node *node, vm_page_t *page, unsigned order)
+{
+	page->order = order;
+	page->on_freelist = true;
+	vmp_pgq_insert_head(&node->free_area[order], page);
+}
+
+static void
+buddy_remove(struct vmp_node *node, vm_page_t *page)
+{
+	vmp_pgq_remove(&node->free_area[page->order], page);
+	page->on_freelist = false;
+}
+
+vm_page_t *
+vmp_buddy_alloc(struct vmp_node *node, unsigned order)
+{
+	vm_page_t *page;
+	unsigned k;
+
+	for (k = order; k < VMP_BUDDY_ORDERS; k++)
+		if (!vmp_pgq_empty(&node->free_area[k]))
+			break;
+	if (k == VMP_BUDDY_ORDERS)
+		return NULL;
+
+	page = vmp_pgq_first(&node->free_area[k]);
+	buddy_remove(node, page);
+
+	/* split, giving back the upper half each time */
+	while (k > order) {
+		k--;
+		buddy_insert(node,
+		    vmp_pfn_to_page(page->pfn + ((pfn_t)1 << k)), k);
+	}
+
+	page->order = order;
+	return page;
+}
+
+vm_page_t *
+vmp_buddy_alloc_pfn(struct vmp_node *node, pfn_t pfn, unsigned max_order)
+{
+	pfn_t head = pfn;
+	unsigned k;
+
+	/* the node's range may take in holes and other nodes' sections */
+	if (!vmp_pfn_valid(pfn) || vmp_pfn_section(pfn)->node != node->id)
+		return NULL;
+
+	/* find the head of the free block containing the page, if any */
+	for (k = 0; k < max_order; k++) {
+		head = pfn & ~(((pfn_t)1 << k) - 1);
+		if (vmp_pfn_to_page(head)->on_freelist &&
+		    vmp_pfn_to_page(head)->order == k)
+			break;
+	}
+	if (k == max_order)
+		return NULL;
+
+	buddy_remove(node, vmp_pfn_to_page(head));
+
+	/* split, giving back the half without the page each time */
+	while (k > 0) {
+		k--;
+		if (pfn & ((pfn_t)1 << k)) {
+			buddy_insert(node, vmp_pfn_to_page(head), k);
+			head += (pfn_t)1 << k;
+		} else
+			buddy_insert(node,
+			    vmp_pfn_to_page(head + ((pfn_t)1 << k)), k);
+	}
+
+	vmp_pfn_to_page(pfn)->order = 0;
+	return vmp_pfn_to_page(pfn);
+}
+
+void
+vmp_buddy_free(vm_page_t *page, unsigned order)
+{
+	struct vmp_node *node = vmp_page_node(page);
+	pfn_t pfn = page->pfn;
+
+	kassert((pfn & (((pfn_t)1 << order) - 1)) == 0);
+
+	while (order < VMP_BUDDY_ORDERS - 1) {
+		pfn_t buddy_pfn = pfn ^ ((pfn_t)1 << order);
+		vm_page_t *buddy;
+
+		/* blocks never span sections, and so never nodes */
+		if (!vmp_pfn_valid(buddy_pfn))
+			break;
+
+		buddy = vmp_pfn_to_page(buddy_pfn);
+		if (!buddy->on_freelist || buddy->order != order)
+			break;
+
+		buddy_remove(node, buddy);
+		pfn &= ~((pfn_t)1 << order);
+		order++;
+	}
+
+	buddy_insert(node, vmp_pfn_to_page(pfn), order);
+}
+
+/*!
+ * Give the \p npages pages from \p base, all present and the node's, to the
+ * node's free queues. The top \p nzeroed are known to be zeroed already and go
+ * straight onto the zeroed queue; the rest are carved into the largest buddy
+ * blocks that fit.
+ */
+static void
+node_add_pages(struct vmp_node *node, pfn_t base, size_t npages,
+    size_t nzeroed)
+{
+	pfn_t end = base + npages - nzeroed;
+
+	for (pfn_t pfn = end; pfn < base + npages; pfn++)
+		vmp_pgq_insert_tail(&node->zero_pgq, vmp_pfn_to_page(pfn));
+
+	for (pfn_t pfn = base; pfn < end;) {
+		unsigned order = VMP_BUDDY_ORDERS - 1;
+		while ((pfn & (((pfn_t)1 << order) - 1)) != 0 ||
+		    pfn + ((pfn_t)1 << order) > end)
+			order--;
+		buddy_insert(node, vmp_pfn_to_page(pfn), order);
+		pfn += (pfn_t)1 << order;
+	}
+
+	vmp_stat_adjust(node, nfree, npages - nzeroed);
+	vmp_stat_adjust(node, nzeroed, nzeroed);
+	vmp_stat_adjust(node, ntotal, npages);
+	vmp_stat_adjust(node, nuse[kPageUseFree], npages);
+}
+
+/*!
+ * Set up one node's queues over its PFN range. Fresh anonymous mappings read
+ * as zeroes, so the zeroer's target of pages is taken from the top of the node
+ * straight onto the zeroed queue.
+ */
+static void
+node_init(struct vmp_node *node, unsigned id, enum vmp_tier tier, pfn_t base,
+    size_t npages)
+{
+	node->id = id;
+	node->tier = tier;
+	node->base_pfn = base;
+	node->npages = npages;
+	ke_spinlock_init(&node->free_lock);
+	ke_spinlock_init(&node->standby_lock);
+	ke_spinlock_init(&node->modified_lock);
+	for (int i = 0; i < VMP_BUDDY_ORDERS; i++)
+		vmp_pgq_init(&node->free_area[i]);
+	vmp_pgq_init(&node->zero_pgq);
+	for (int i = 0; i < VMP_STANDBY_PRIORITIES; i++)
+		vmp_pgq_init(&node->standby_pgq[i]);
+	node->standby_mask = 0;
+	vmp_pgq_init(&node->modified_pgq);
+
+	node_add_pages(node, base, npages,
+	    MIN(vmparam.zeroed_target, npages));
+}
+
+/*!
+ * Make the section starting at \p base present, with \p npages pages of node
+ * \p nodeid and the PFN database entries at \p pages and \p cold, which must
+ * be zeroed. The pages are free but on no queue yet.
+ */
+static void
+section_init(pfn_t base, size_t npages, unsigned nodeid, vm_page_t *pages,
+    vm_page_cold_t *cold)
+{
+	struct vmp_section *section = vmp_pfn_section(base);
+
+	kassert(base % VMP_SECTION_PAGES == 0 && npages <= VMP_SECTION_PAGES);
+	kassert(section->npages == 0);
+
+	for (size_t i = 0; i < npages; i++) {
+		pages[i].pfn = base + i;
+		pages[i].dirty = false;
+		pages[i].refcnt = 0;
+		pages[i].use = kPageUseFree;
+	}
+
+	section->pages = pages;
+	section->cold = cold;
+	section->node = nodeid;
+	/* last, as this is what makes the section valid to unlocked readers */
+	atomic_store_explicit((_Atomic uint32_t *)&section->npages, npages,
+	    memory_order_release);
+}
+
+/*!
+ * @brief Set up the simulated physical arena and its PFN database, split into
+ * \p nnodes NUMA nodes of (near enough) equal size. The last \p nslow nodes are
+ * the slow tier.
+ *
+ * Memory is present from address 0 for \p npages pages; the physical address
+ * space runs to \p maxpages, and the rest of it may be added to later with
+ * vm_page_hot_add(). Each node gets whole sections, but for the last's
+ * remainder.
+ *
+ * All are mapped lazily, so a large arena only costs host memory for the
+ * pages actually touched (the hot part of the PFN database is touched in full
+ * here.)
+ */
+void
+SIM_pages_init(size_t npages, size_t maxpages, unsigned nnodes, unsigned nslow)
+{
+	enum soft_arena_backing backing;
+	size_t nsections = roundup(npages, VMP_SECTION_PAGES) /
+	    VMP_SECTION_PAGES;
+	size_t node_span = MAX(npages / nnodes, VMP_SECTION_PAGES) /
+	    VMP_SECTION_PAGES * VMP_SECTION_PAGES;
+	vm_page_t *pages;
+	vm_page_cold_t *cold;
+
+	kassert(npages > 0 && maxpages >= npages && maxpages < VMP_PGQ_NONE);
+	kassert(nnodes > 0 && nnodes <= VMP_MAX_NODES &&
+	    (nnodes - 1) * node_span < npages);
+	kassert(nslow < nnodes);
+
+	SOFT_npages = maxpages;
+	vmp_page_kernels_init();
+	vmp_stat_init(npages);
+	SOFT_pages = sim_arena_alloc(maxpages * PGSIZE, &backing);
+	kprintf("Simulated memory: %zu KiB on %s\n", npages * PGSIZE / 1024,
+	    arena_backing_names[backing]);
+
+	vmp_nsections = roundup(maxpages, VMP_SECTION_PAGES) /
+	    VMP_SECTION_PAGES;
+	vmp_sections = sim_arena_alloc(roundup(vmp_nsections *
+	    sizeof(struct vmp_section), PGSIZE), &backing);
+
+	/* the boot sections' PFN database is one piece, for locality */
+	pages = sim_arena_alloc(roundup(nsections * VMP_SECTION_PAGES *
+	    sizeof(vm_page_t), PGSIZE), &backing);
+	/* the cold part is already as it should be: zeroed */
+	cold = sim_arena_alloc(roundup(nsections * VMP_SECTION_PAGES *
+	    sizeof(vm_page_cold_t), PGSIZE), &backing);
+
+	vmp_nnodes = nnodes;
+	nfast_nodes = nnodes - nslow;
+	for (unsigned i = 0; i < nnodes; i++) {
+		pfn_t base = i * node_span;
+		size_t span = i == nnodes - 1 ? npages - base : node_span;
+
+		for (pfn_t pfn = base; pfn < base + span;
+		     pfn += VMP_SECTION_PAGES)
+			section_init(pfn, MIN(VMP_SECTION_PAGES,
+					      base + span - pfn),
+			    i, &pages[pfn], &cold[pfn]);
+
+		node_init(&vmp_nodes[i], i,
+		    i < nfast_nodes ? kVMPTierFast : kVMPTierSlow, base, span);
+	}
+
+	vmp_page_alloc(&vmp_zero_page, kPageUseKWired, true);
+}
+
+static struct vmp_magazine *
+magazine_get(struct vmp_node *node)
+{
+	struct vmp_magazine *mag = this_magazines[node->id];
+
+	if (mag == NULL) {
+		ipl_t ipl;
+
+		mag = kmem_alloc(sizeof(*mag));
+		ke_spinlock_init(&mag->lock);
+		mag->node = node;
+		mag->nzeroed = 0;
+		mag->nfree = 0;
+		ipl = ke_spinlock_acquire(&magazines_lock);
+		TAILQ_INSERT_TAIL(&magazines, mag, link);
+		ke_spinlock_release(&magazines_lock, ipl);
+		this_magazines[node->id] = mag;
+	}
+
+	return mag;
+}
+
+/*!
+ * Fill a magazine's zeroed stack with a batch from the zeroed queue. If there
+ * are no zeroed pages and the free stack is empty too, fill that with a batch
+ * from the buddy allocator instead.
+ */
+static void
+magazine_refill(struct vmp_magazine *mag) LOCK_REQUIRES(mag->lock)
+{
+	struct vmp_node *node = mag->node;
+	ipl_t ipl = ke_spinlock_acquire(&node->free_lock);
+
+	while (mag->nzeroed < MAGAZINE_BATCH) {
+		vm_page_t *page = vmp_pgq_first(&node->zero_pgq);
+		if (page == NULL)
+			break;
+		vmp_pgq_remove(&node->zero_pgq, page);
+		mag->zeroed[mag->nzeroed++] = page;
+	}
+
+	while (mag->nzeroed == 0 && mag->nfree < MAGAZINE_BATCH) {
+		vm_page_t *page = vmp_buddy_alloc(node, 0);
+		if (page == NULL)
+			break;
+		mag->free[mag->nfree++] = page;
+	}
+
+	ke_spinlock_release(&node->free_lock, ipl);
+
+	if (vmp_stat_read(&node->stat, nzeroed) < vmparam.zeroed_target)
+		ke_event_signal(&vmp_zeroer_event);
+}
+
+/*! Return up to \p count of the least recently freed pages to the buddy. */
+static void
+magazine_drain_free(struct vmp_magazine *mag, size_t count)
+    LOCK_REQUIRES(mag->lock)
+{
+	ipl_t ipl;
+
+	count = MIN(count, mag->nfree);
+	if (count == 0)
+		return;
+
+	ipl = ke_spinlock_acquire(&mag->node->free_lock);
+	for (size_t i = 0; i < count; i++)
+		vmp_buddy_free(mag->free[i], 0);
+	ke_spinlock_release(&mag->node->free_lock, ipl);
+
+	if (vmp_stat_read(&mag->node->stat, nzeroed) <
+	    vmparam.zeroed_target)
+		ke_event_signal(&vmp_zeroer_event);
+
+	mag->nfree -= count;
+	memmove(&mag->free[0], &mag->free[count],
+	    mag->nfree * sizeof(vm_page_t *));
+}
+
+/*! Give back every page held in every magazine to its node's queues. */
+static void
+magazines_drain_all(void)
+{
+	struct vmp_magazine *mag;
+	ipl_t ipl, mag_ipl, free_ipl;
 
-vmp_page_queue_t free_pgq = TAILQ_HEAD_INITIALIZER(free_pgq),
-		 standby_pgq = TAILQ_HEAD_INITIALIZER(standby_pgq),
-		 modified_pgq = TAILQ_HEAD_INITIALIZER(modified_pgq);
+	ipl = ke_spinlock_acquire(&magazines_lock);
+	TAILQ_FOREACH (mag, &magazines, link) {
+		mag_ipl = ke_spinlock_acquire(&mag->lock);
+		free_ipl = ke_spinlock_acquire(&mag->node->free_lock);
+		while (mag->nzeroed > 0)
+			vmp_pgq_insert_head(&mag->node->zero_pgq,
+			    mag->zeroed[--mag->nzeroed]);
+		ke_spinlock_release(&mag->node->free_lock, free_ipl);
+		magazine_drain_free(mag, mag->nfree);
+		ke_spinlock_release(&mag->lock, mag_ipl);
+	}
+	ke_spinlock_release(&magazines_lock, ipl);
+}
 
 void
-SIM_pages_init(void)
+vmp_free_caches_reclaim(void)
 {
-	for (int i = 0; i < SOFT_NPAGES; i++) {
-		mypages[i].pfn = i;
-		mypages[i].dirty = false;
-		mypages[i].referent_pte = 0;
-		mypages[i].nonzero_ptes = 0;
-		mypages[i].refcnt = 0;
-		mypages[i].use = kPageUseFree;
-		TAILQ_INSERT_TAIL(&free_pgq, &mypages[i], queue_link);
+	magazines_drain_all();
+
+	for (unsigned i = 0; i < vmp_nnodes; i++) {
+		struct vmp_node *node = &vmp_nodes[i];
+		vm_page_t *page;
+		ipl_t ipl = ke_spinlock_acquire(&node->free_lock);
+
+		while ((page = vmp_pgq_first(&node->zero_pgq)) != NULL) {
+			vmp_pgq_remove(&node->zero_pgq, page);
+			vmp_buddy_free(page, 0);
+			vmp_stat_adjust(node, nzeroed, -1);
+			vmp_stat_adjust(node, nfree, 1);
+		}
+
+		ke_spinlock_release(&node->free_lock, ipl);
 	}
-	vmstat.nfree = SOFT_NPAGES;
+}
+
+/*! Put a page freshly made free into this thread's magazine for its node. */
+static void
+magazine_free(vm_page_t *page)
+{
+	struct vmp_magazine *mag = magazine_get(vmp_page_node(page));
+	ipl_t ipl = ke_spinlock_acquire(&mag->lock);
+
+	if (mag->nfree == MAGAZINE_SIZE)
+		magazine_drain_free(mag, MAGAZINE_BATCH);
+	mag->free[mag->nfree++] = page;
+
+	ke_spinlock_release(&mag->lock, ipl);
 }
 
 bool
@@ -38,10 +556,12 @@ check_shortage(void)
 
 		ke_event_clear(&vmp_sufficient_pages_event);
 
-		if (vmstat.nmodified > 4)
+		size_t nmodified = vmp_stat_read(&vmstat, nmodified);
+
+		if (nmodified > 4)
 			ke_event_signal(&vmp_pgwriter_event);
 
-		if ((vmstat.nmodified + vmstat.nstandby) <
+		if (nmodified + vmp_stat_read(&vmstat, nstandby) <
 		    vmparam.min_avail_for_alloc * 2)
 			ke_event_signal(&vmp_balancer_event);
 
@@ -50,27 +570,116 @@ check_shortage(void)
 	return false;
 }
 
+/*! Put a clean inactive page on the standby list for its priority. */
+static void
+standby_insert(struct vmp_node *node, vm_page_t *page)
+    LOCK_REQUIRES(node->standby_lock)
+{
+	vmp_pgq_insert_tail(&node->standby_pgq[page->standby_priority], page);
+	atomic_fetch_or_explicit(&node->standby_mask,
+	    1u << page->standby_priority, memory_order_relaxed);
+	vmp_stat_adjust(node, nstandby, 1);
+	vmp_stat_adjust(node, nstandby_prio[page->standby_priority], 1);
+}
+
+static void
+standby_remove(struct vmp_node *node, vm_page_t *page)
+    LOCK_REQUIRES(node->standby_lock)
+{
+	vmp_pgq_remove(&node->standby_pgq[page->standby_priority], page);
+	if (vmp_pgq_empty(&node->standby_pgq[page->standby_priority]))
+		atomic_fetch_and_explicit(&node->standby_mask,
+		    ~(1u << page->standby_priority), memory_order_relaxed);
+	vmp_stat_adjust(node, nstandby, -1);
+	vmp_stat_adjust(node, nstandby_prio[page->standby_priority], -1);
+}
+
+/*!
+ * Take the first page that can be locked off \p node's standby list of
+ * priority \p prio. The standby mask is kept under the standby lock, so an
+ * empty list can be skipped without taking it.
+ *
+ * Pages are only trylocked, since the standby lock is held; any page someone
+ * else has locked is about to leave the list anyway.
+ */
 static vm_page_t *
-steal_page(enum vm_page_use use)
+standby_take(struct vmp_node *node, unsigned prio)
 {
 	vm_page_t *page;
+	ipl_t ipl;
 
-	kassert(ke_spinlock_held(&vmp_pfn_lock));
-
-	page = TAILQ_FIRST(&standby_pgq);
-	if (page == NULL)
+	if (!(atomic_load_explicit(&node->standby_mask, memory_order_relaxed) &
+		(1u << prio)))
 		return NULL;
 
-	TAILQ_REMOVE(&standby_pgq, page, queue_link);
+	ipl = ke_spinlock_acquire(&node->standby_lock);
+	VMP_PGQ_FOREACH (page, &node->standby_pgq[prio])
+		if (vmp_page_trylock(page))
+			break;
+	if (page != NULL) {
+		standby_remove(node, page);
+		vmp_stat_adjust(node, nrepurposed[prio], 1);
+	}
+	ke_spinlock_release(&node->standby_lock, ipl);
+
+	return page;
+}
+
+/*!
+ * Repurpose a standby page. The lowest priority standby lists are drained
+ * first, across all nodes, and among pages of equal priority one from node
+ * \p nodeid is preferred.
+ */
+static vm_page_t *
+steal_page(unsigned nodeid, enum vm_page_use use)
+{
+	struct vmp_node *node;
+	vm_page_t *page;
+	vm_page_cold_t *cold;
+
+	for (unsigned prio = 0; prio < VMP_STANDBY_PRIORITIES; prio++) {
+		for (unsigned i = 0; i < vmp_nnodes; i++) {
+			node = node_fallback(nodeid, i);
+			page = standby_take(node, prio);
+			if (page != NULL)
+				goto found;
+		}
+	}
+
+	return NULL;
+
+found:
+	cold = vmp_page_cold(page);
 
 	switch (page->use) {
 	case kPageUseAnonPrivate: {
-		pte_t *pte = (pte_t *)P2V(page->referent_pte);
+		pte_t *pte = (pte_t *)P2V(cold->referent_pte);
 		vm_page_t *table_page = vmp_paddr_to_page(
-		    (page->referent_pte / PGSIZE) * PGSIZE);
-		vmp_pte_swap_create(pte, page->drumslot);
+		    (cold->referent_pte / PGSIZE) * PGSIZE);
+		vmp_pte_swap_create(pte, cold->drumslot);
 		/* get ps from owner field */
-		vmp_pagetable_page_pte_became_swap(page->process, table_page);
+		vmp_pagetable_page_pte_became_swap(cold->process, table_page);
+		break;
+	}
+
+	case kPageUsePML1:
+	case kPageUsePML2:
+	case kPageUsePML3: {
+		/*
+		 * an evicted table, written to the pagefile; all its PTEs are
+		 * swap PTEs, so it refers to no pages, and is counted afresh
+		 * when read back in.
+		 */
+		pte_t *pte = (pte_t *)P2V(cold->referent_pte);
+		vm_page_t *dirpage = vmp_paddr_to_page(
+		    (cold->referent_pte / PGSIZE) * PGSIZE);
+		kassert(cold->nonswap_ptes == 0);
+		kassert(cold->drumslot != -1 &&
+		    !vmp_drumslot_is_cstore(cold->drumslot));
+		vmp_pte_swap_create(pte, cold->drumslot);
+		vmp_pagetable_page_pte_became_swap(cold->process, dirpage);
+		cold->nonzero_ptes = 0;
+		vmp_stat_adjust(node, ntable_paged_out, 1);
 		break;
 	}
 
@@ -78,35 +687,82 @@ steal_page(enum vm_page_use use)
 		kfatal("Can't steal page of use %d\n", page->use);
 	}
 
-	kassert(page->refcnt == 0);
-	kassert(page->nonzero_ptes == 0);
-	page->referent_pte = 0;
-	page->refcnt = 1;
-	page->use = use;
+	kassert(vmp_page_refcnt(page) == 0);
+	kassert(cold->nonzero_ptes == 0);
+	cold->referent_pte = 0;
+	vmp_page_set_use(page, use);
 	page->dirty = false;
-	page->drumslot = -1;
+	cold->reused = false;
+	cold->drumslot = -1;
+	atomic_fetch_add_explicit(&page->refcnt, 1, memory_order_relaxed);
+	vmp_page_unlock(page);
+
+	vmp_stat_adjust(node, nactive, 1);
 
-	vmstat.nstandby--;
-	vmstat.nactive++;
+	return page;
+}
 
-	memset((void *)vm_page_direct_map_addr(page), 0x0, PGSIZE);
+/*!
+ * Take a free page from \p node, preferring a zeroed one; \p zeroed is set to
+ * whether the page is known to be zeroed.
+ */
+static vm_page_t *
+node_page_get(struct vmp_node *node, bool *zeroed)
+{
+	struct vmp_magazine *mag = magazine_get(node);
+	vm_page_t *page = NULL;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&mag->lock);
+
+	/*
+	 * a zeroed page is preferred to one freed here, if the node has any
+	 * (the count is only a hint, so isn't locked for.)
+	 */
+	if (mag->nzeroed == 0 &&
+	    (mag->nfree == 0 || vmp_stat_read(&node->stat, nzeroed) > 0))
+		magazine_refill(mag);
+
+	if (mag->nzeroed > 0) {
+		page = mag->zeroed[--mag->nzeroed];
+		vmp_stat_adjust(node, nzeroed, -1);
+		*zeroed = true;
+	} else if (mag->nfree > 0) {
+		page = mag->free[--mag->nfree];
+		vmp_stat_adjust(node, nfree, -1);
+		*zeroed = false;
+	}
+
+	ke_spinlock_release(&mag->lock, ipl);
 
 	return page;
 }
 
 int
-vmp_page_alloc_locked(vm_page_t **out, enum vm_page_use use, bool must)
+vmp_page_alloc_node(vm_page_t **out, unsigned nodeid, enum vm_page_use use,
+    bool must)
 {
-	vm_page_t *page;
+	vm_page_t *page = NULL;
+	bool zeroed, drained = false;
 
-	kassert(ke_spinlock_held(&vmp_pfn_lock));
+	kassert(nodeid < vmp_nnodes);
 
 	if (check_shortage() && !must)
 		return -1;
 
-	page = TAILQ_FIRST(&free_pgq);
+retry:
+	for (unsigned i = 0; i < vmp_nnodes && page == NULL; i++)
+		page = node_page_get(node_fallback(nodeid, i), &zeroed);
+
 	if (page == NULL) {
-		page = steal_page(use);
+		if (!drained && vmp_free_pages() > 0) {
+			/* other threads' magazines are holding free pages */
+			magazines_drain_all();
+			drained = true;
+			goto retry;
+		}
+
+		page = steal_page(nodeid, use);
 		if (page == NULL) {
 			if (must)
 				kfatal("Out of pages\n");
@@ -114,25 +770,260 @@ vmp_page_alloc_locked(vm_page_t **out, enum vm_page_use use, bool must)
 				return -1;
 		}
 
+		vmp_page_zero(page, false);
 		*out = page;
 		return 0;
-	} else
-		TAILQ_REMOVE(&free_pgq, page, queue_link);
-
-	kassert(page->refcnt == 0);
-	kassert(page->nonzero_ptes == 0);
-	kassert(page->referent_pte == 0);
-	page->refcnt = 1;
-	page->use = use;
+	}
+
+	/* the fast tier is full; have the tier migrator make room in it */
+	if (vmp_nodes[nodeid].tier == kVMPTierFast &&
+	    vmp_page_node(page)->tier == kVMPTierSlow)
+		ke_event_signal(&vmp_tier_event);
+
+	/*
+	 * the page is ours alone now, so needs no locking to set up; but the
+	 * migrator may be trying its lock, so the count is added to atomically
+	 */
+	kassert(vmp_page_refcnt(page) == 0);
+	kassert(vmp_page_cold(page)->nonzero_ptes == 0);
+	kassert(vmp_page_cold(page)->referent_pte == 0);
+	atomic_fetch_add_explicit(&page->refcnt, 1, memory_order_relaxed);
+	vmp_page_set_use(page, use);
 	page->dirty = false;
-	page->drumslot = -1;
+	vmp_page_cold(page)->reused = false;
+	vmp_page_cold(page)->drumslot = -1;
+
+	vmp_stat_adjust(vmp_page_node(page), nactive, 1);
 
-	vmstat.nfree--;
-	vmstat.nactive++;
+	if (!zeroed)
+		vmp_page_zero(page, false);
 
 	*out = page;
 
-	memset((void *)vm_page_direct_map_addr(page), 0x0, PGSIZE);
+	return 0;
+}
+
+int
+vmp_page_alloc(vm_page_t **out, enum vm_page_use use, bool must)
+{
+	return vmp_page_alloc_node(out, vmp_current_node(), use, must);
+}
+
+/*!
+ * Pages being gathered for vmp_page_alloc_batch(). Zeroed pages fill out[]
+ * from the front and pages still needing zeroing from the back, so the batch
+ * is complete when the two meet. Stolen pages are the first nstolen of those
+ * at the back.
+ */
+struct page_batch {
+	vm_page_t **out;
+	size_t npages;
+	size_t head, tail;
+	size_t nstolen;
+};
+
+/*! Take as many of a batch's pages as \p node can give, locking each once. */
+static void
+node_batch_get(struct vmp_node *node, struct page_batch *batch)
+{
+	struct vmp_magazine *mag = magazine_get(node);
+	size_t nzeroed = 0, nfree = 0;
+	vm_page_t *page;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&mag->lock);
+	while (batch->head < batch->tail && mag->nzeroed > 0) {
+		batch->out[batch->head++] = mag->zeroed[--mag->nzeroed];
+		nzeroed++;
+	}
+	while (batch->head < batch->tail && mag->nfree > 0) {
+		batch->out[--batch->tail] = mag->free[--mag->nfree];
+		nfree++;
+	}
+	ke_spinlock_release(&mag->lock, ipl);
+
+	if (batch->head < batch->tail) {
+		ipl = ke_spinlock_acquire(&node->free_lock);
+		while (batch->head < batch->tail &&
+		    (page = vmp_pgq_first(&node->zero_pgq)) != NULL) {
+			vmp_pgq_remove(&node->zero_pgq, page);
+			batch->out[batch->head++] = page;
+			nzeroed++;
+		}
+		while (batch->head < batch->tail &&
+		    (page = vmp_buddy_alloc(node, 0)) != NULL) {
+			batch->out[--batch->tail] = page;
+			nfree++;
+		}
+		ke_spinlock_release(&node->free_lock, ipl);
+	}
+
+	vmp_stat_adjust(node, nzeroed, -nzeroed);
+	vmp_stat_adjust(node, nfree, -nfree);
+
+	if (vmp_stat_read(&node->stat, nzeroed) < vmparam.zeroed_target)
+		ke_event_signal(&vmp_zeroer_event);
+}
+
+/*! Give back the pages of a batch that couldn't be completed. */
+static void
+batch_giveback(struct page_batch *batch)
+{
+	for (size_t i = 0; i < batch->npages; i++) {
+		vm_page_t *page = batch->out[i];
+		struct vmp_node *node;
+		ipl_t ipl;
+
+		if (i >= batch->head && i < batch->tail)
+			continue;
+
+		if (i >= batch->tail && i < batch->tail + batch->nstolen) {
+			/* already set up for use, so free it as any other */
+			vmp_page_set_use(page, kPageUseDeleted);
+			vmp_page_release(page);
+			continue;
+		}
+
+		node = vmp_page_node(page);
+		if (i < batch->head) {
+			ipl = ke_spinlock_acquire(&node->free_lock);
+			vmp_pgq_insert_head(&node->zero_pgq, page);
+			ke_spinlock_release(&node->free_lock, ipl);
+			vmp_stat_adjust(node, nzeroed, 1);
+		} else {
+			vmp_stat_adjust(node, nfree, 1);
+			magazine_free(page);
+		}
+	}
+}
+
+int
+vmp_page_alloc_batch(enum vm_page_use use, size_t npages, vm_page_t **out)
+{
+	struct page_batch batch = { out, npages, 0, npages, 0 };
+	unsigned nodeid = vmp_current_node();
+	bool drained = false;
+
+	if (npages == 0)
+		return 0;
+
+	/* one check for the lot, which mustn't eat into the reserve */
+	if (check_shortage() ||
+	    vmp_avail_pages() < npages + vmparam.min_avail_for_alloc)
+		return -1;
+
+retry:
+	for (unsigned i = 0; i < vmp_nnodes && batch.head < batch.tail; i++)
+		node_batch_get(node_fallback(nodeid, i), &batch);
+
+	if (batch.head < batch.tail && !drained &&
+	    vmp_free_pages() > 0) {
+		/* other threads' magazines are holding free pages */
+		magazines_drain_all();
+		drained = true;
+		goto retry;
+	}
+
+	while (batch.head < batch.tail) {
+		vm_page_t *page = steal_page(nodeid, use);
+		if (page == NULL) {
+			batch_giveback(&batch);
+			return -1;
+		}
+		batch.out[--batch.tail] = page;
+		batch.nstolen++;
+	}
+
+	/* the pages are ours alone now, so need no locking to set up */
+	for (size_t i = 0; i < npages; i++) {
+		vm_page_t *page = out[i];
+
+		if (i >= batch.tail && i < batch.tail + batch.nstolen)
+			continue;
+
+		kassert(vmp_page_refcnt(page) == 0);
+		kassert(vmp_page_cold(page)->nonzero_ptes == 0);
+		kassert(vmp_page_cold(page)->referent_pte == 0);
+		atomic_fetch_add_explicit(&page->refcnt, 1,
+		    memory_order_relaxed);
+		vmp_page_set_use(page, use);
+		page->dirty = false;
+		vmp_page_cold(page)->reused = false;
+		vmp_page_cold(page)->drumslot = -1;
+		vmp_stat_adjust(vmp_page_node(page), nactive, 1);
+	}
+
+	for (size_t i = batch.tail; i < npages; i++)
+		vmp_page_zero(out[i], false);
+
+	return 0;
+}
+
+int
+vmp_page_alloc_order(vm_page_t **out, unsigned order, enum vm_page_use use,
+    bool must)
+{
+	return vmp_page_alloc_order_node(out, vmp_current_node(), order, use,
+	    must);
+}
+
+int
+vmp_page_alloc_order_node(vm_page_t **out, unsigned nodeid, unsigned order,
+    enum vm_page_use use, bool must)
+{
+	size_t npages = (size_t)1 << order;
+	vm_page_t *page = NULL;
+	bool reclaimed = false;
+
+	kassert(order < VMP_BUDDY_ORDERS);
+
+	if (order == 0)
+		return vmp_page_alloc_node(out, nodeid, use, must);
+
+	if (check_shortage() && !must)
+		return -1;
+
+retry:
+	for (unsigned i = 0; i < vmp_nnodes && page == NULL; i++) {
+		struct vmp_node *node = node_fallback(nodeid, i);
+		ipl_t ipl = ke_spinlock_acquire(&node->free_lock);
+		page = vmp_buddy_alloc(node, order);
+		ke_spinlock_release(&node->free_lock, ipl);
+	}
+
+	if (page == NULL) {
+		if (!reclaimed) {
+			vmp_free_caches_reclaim();
+			reclaimed = true;
+			goto retry;
+		}
+
+		vmp_compact_request(nodeid, order);
+
+		if (must)
+			kfatal("Out of contiguous pages (order %u)\n", order);
+		else
+			return -1;
+	}
+
+	for (size_t i = 0; i < npages; i++) {
+		kassert(vmp_page_refcnt(&page[i]) == 0);
+		kassert(vmp_page_cold(&page[i])->referent_pte == 0);
+		atomic_fetch_add_explicit(&page[i].refcnt, 1,
+		    memory_order_relaxed);
+		vmp_page_set_use(&page[i], use);
+		page[i].dirty = false;
+		vmp_page_cold(&page[i])->reused = false;
+		vmp_page_cold(&page[i])->drumslot = -1;
+	}
+
+	vmp_stat_adjust(vmp_page_node(page), nfree, -npages);
+	vmp_stat_adjust(vmp_page_node(page), nactive, npages);
+
+	for (size_t i = 0; i < npages; i++)
+		vmp_page_zero(&page[i], false);
+
+	*out = page;
 
 	return 0;
 }
@@ -140,73 +1031,252 @@ vmp_page_alloc_locked(vm_page_t **out, enum vm_page_use use, bool must)
 vm_page_t *
 vmp_page_retain_locked(vm_page_t *page)
 {
-	if (page->refcnt++ == 0) {
+	uint16_t old;
+
+	kassert(vmp_page_is_locked(page));
+
+	old = atomic_fetch_add_explicit(&page->refcnt, 1, memory_order_acquire);
+	if ((old & VMP_PAGE_REFCNT_MASK) == 0) {
 		/* going from inactive to active state */
+		struct vmp_node *node = vmp_page_node(page);
+		ipl_t ipl;
+
 		kassert(page->use != kPageUseDeleted);
 		if (page->dirty) {
-			TAILQ_REMOVE(&modified_pgq, page, queue_link);
-			vmstat.nmodified -= 1;
-			vmstat.nactive += 1;
+			ipl = ke_spinlock_acquire(&node->modified_lock);
+			vmp_pgq_remove(&node->modified_pgq, page);
+			ke_spinlock_release(&node->modified_lock, ipl);
+			vmp_stat_adjust(node, nmodified, -1);
 		} else {
-			TAILQ_REMOVE(&standby_pgq, page, queue_link);
-			vmstat.nstandby -= 1;
-			vmstat.nactive += 1;
+			ipl = ke_spinlock_acquire(&node->standby_lock);
+			standby_remove(node, page);
+			ke_spinlock_release(&node->standby_lock, ipl);
 		}
+		vmp_stat_adjust(node, nactive, 1);
 	}
 
 	return page;
 }
 
+/*!
+ * Signal whoever waits for free pages once a shortage is over, or the pager
+ * threads if there is (still) one. Done after pages are made available.
+ */
+static void
+shortage_update(void)
+{
+	check_shortage();
+	if (vmp_was_shortage && vmp_page_sufficience() &&
+	    atomic_exchange(&vmp_was_shortage, false))
+		ke_event_signal(&vmp_sufficient_pages_event);
+}
+
+/*! Check that a page which just lost its last reference can be queued. */
+static void
+page_check_pageable(vm_page_t *page)
+{
+	switch (page->use) {
+	case kPageUseAnonPrivate:
+	case kPageUsePML1:
+	case kPageUsePML2:
+	case kPageUsePML3:
+		break;
+
+	default:
+		kfatal("Release page of unexpected type\n");
+	}
+}
+
+/*! Put a pageable page that just lost its last reference on the right queue. */
+static void
+page_deactivate(vm_page_t *page) LOCK_REQUIRES(page)
+{
+	struct vmp_node *node = vmp_page_node(page);
+	ipl_t ipl;
+
+	vmp_stat_adjust(node, nactive, -1);
+	page_check_pageable(page);
+
+	if (page->dirty) {
+		ipl = ke_spinlock_acquire(&node->modified_lock);
+		vmp_pgq_insert_tail(&node->modified_pgq, page);
+		ke_spinlock_release(&node->modified_lock, ipl);
+		vmp_stat_adjust(node, nmodified, 1);
+	} else {
+		ipl = ke_spinlock_acquire(&node->standby_lock);
+		standby_insert(node, page);
+		ke_spinlock_release(&node->standby_lock, ipl);
+	}
+
+	shortage_update();
+}
+
+/*!
+ * Free a deleted page that just lost its last reference. The page lock is
+ * dropped first; nothing else can find the page by now.
+ */
+static void
+page_free_deleted(vm_page_t *page) LOCK_REQUIRES(page)
+{
+	struct vmp_node *node = vmp_page_node(page);
+
+	vmp_page_set_use(page, kPageUseFree);
+	vmp_page_unlock(page);
+	vmp_stat_adjust(node, nactive, -1);
+	vmp_stat_adjust(node, nfree, 1);
+	magazine_free(page);
+
+	shortage_update();
+}
+
+/*!
+ * Drop a reference to a page without locking it if it isn't the last one.
+ * Returns false, having done nothing, if it is the last.
+ */
+static bool
+page_release_fast(vm_page_t *page)
+{
+	uint16_t old = atomic_load_explicit(&page->refcnt, memory_order_relaxed);
+
+	kassert((old & VMP_PAGE_REFCNT_MASK) > 0);
+
+	/* only the 1->0 transition needs the lock */
+	while ((old & VMP_PAGE_REFCNT_MASK) > 1) {
+		if (atomic_compare_exchange_weak_explicit(&page->refcnt, &old,
+			old - 1, memory_order_release, memory_order_relaxed))
+			return true;
+	}
+
+	return false;
+}
+
 void
 vmp_page_release_locked(vm_page_t *page)
 {
-	kassert(page >= mypages && page <= &mypages[SOFT_NPAGES]);
-	kassert(page->refcnt > 0);
+	uint16_t old;
+
+	kassert(vmp_pfn_valid(page->pfn) && vmp_pfn_to_page(page->pfn) == page);
+	kassert(vmp_page_is_locked(page));
+	kassert(vmp_page_refcnt(page) > 0);
 	kassert(page->use != kPageUseFree);
 
-	if (page->refcnt-- == 1) {
+	old = atomic_fetch_sub_explicit(&page->refcnt, 1, memory_order_release);
+	if ((old & VMP_PAGE_REFCNT_MASK) == 1) {
 		/* going from active to inactive state */
-		vmstat.nactive -= 1;
-
-		switch (page->use) {
-		case kPageUseDeleted: {
-			TAILQ_INSERT_HEAD(&free_pgq, page, queue_link);
-			vmstat.nfree++;
-			page->use = kPageUseFree;
-			return;
-		}
+		kassert(page->use != kPageUseDeleted);
+		page_deactivate(page);
+	}
+}
 
-		case kPageUseAnonPrivate:
-			break;
+vm_page_t *
+vmp_page_retain(vm_page_t *page)
+{
+	uint16_t old = atomic_load_explicit(&page->refcnt, memory_order_relaxed);
 
-		default:
-			kfatal("Release page of unexpected type\n");
-		}
+	/*
+	 * only the 0->1 transition needs the page lock, and it can only be made
+	 * with the lock held, so a nonzero count here can be bumped freely.
+	 */
+	while ((old & VMP_PAGE_REFCNT_MASK) != 0) {
+		if (atomic_compare_exchange_weak_explicit(&page->refcnt, &old,
+			old + 1, memory_order_acquire, memory_order_relaxed))
+			return page;
+	}
 
-		/* this is a pageable page, so put it on the appropriate q */
+	vmp_page_lock(page);
+	vmp_page_retain_locked(page);
+	vmp_page_unlock(page);
 
-		if (page->dirty) {
-			TAILQ_INSERT_TAIL(&modified_pgq, page, queue_link);
-			vmstat.nmodified += 1;
-		} else {
-			TAILQ_INSERT_TAIL(&standby_pgq, page, queue_link);
-			vmstat.nstandby += 1;
-		}
+	return page;
+}
+
+void
+vmp_page_release(vm_page_t *page)
+{
+	uint16_t old;
+
+	if (page_release_fast(page))
+		return;
+
+	vmp_page_lock(page);
+
+	if (page->use != kPageUseDeleted) {
+		vmp_page_release_locked(page);
+		vmp_page_unlock(page);
+		return;
+	}
+
+	old = atomic_fetch_sub_explicit(&page->refcnt, 1, memory_order_release);
+	if ((old & VMP_PAGE_REFCNT_MASK) != 1) {
+		vmp_page_unlock(page);
+		return;
+	}
+
+	page_free_deleted(page);
+}
+
+int
+vm_page_hot_add(paddr_t base, size_t size, unsigned nodeid)
+{
+	static kmutex_t hot_add_lock = KMUTEX_INITIALISER;
+	pfn_t first = base / PGSIZE, end = first + size / PGSIZE;
+	size_t nsections = roundup(end - first, VMP_SECTION_PAGES) /
+	    VMP_SECTION_PAGES;
+	struct vmp_node *node;
+	vm_page_t *pages;
+	vm_page_cold_t *cold;
+	enum soft_arena_backing backing;
+	ipl_t ipl;
+
+	if (base % (VMP_SECTION_PAGES * PGSIZE) != 0 || size % PGSIZE != 0 ||
+	    size == 0 || end > SOFT_npages || nodeid >= vmp_nnodes)
+		return -1;
 
-		check_shortage();
-		if (vmp_was_shortage && vmp_page_sufficience()) {
-			vmp_was_shortage = false;
-			ke_event_signal(&vmp_sufficient_pages_event);
+	node = &vmp_nodes[nodeid];
+
+	ke_wait(&hot_add_lock, "vm_page_hot_add", false, false, -1);
+
+	for (pfn_t pfn = first; pfn < end; pfn += VMP_SECTION_PAGES) {
+		if (vmp_pfn_section(pfn)->npages != 0) {
+			ke_mutex_release(&hot_add_lock);
+			return -1;
 		}
 	}
+
+	pages = sim_arena_alloc(roundup(nsections * VMP_SECTION_PAGES *
+	    sizeof(vm_page_t), PGSIZE), &backing);
+	cold = sim_arena_alloc(roundup(nsections * VMP_SECTION_PAGES *
+	    sizeof(vm_page_cold_t), PGSIZE), &backing);
+
+	for (pfn_t pfn = first; pfn < end; pfn += VMP_SECTION_PAGES)
+		section_init(pfn, MIN(VMP_SECTION_PAGES, end - pfn), nodeid,
+		    &pages[pfn - first], &cold[pfn - first]);
+
+	ipl = ke_spinlock_acquire(&node->free_lock);
+	if (first < node->base_pfn) {
+		node->npages += node->base_pfn - first;
+		node->base_pfn = first;
+	}
+	node->npages = MAX(node->npages, end - node->base_pfn);
+	/* pages not touched before are zeroed, but leave them to the zeroer */
+	node_add_pages(node, first, end - first, 0);
+	ke_spinlock_release(&node->free_lock, ipl);
+
+	ke_mutex_release(&hot_add_lock);
+
+	kprintf("Hot-added %zu KiB at 0x%lx to node %u\n", size / 1024,
+	    (unsigned long)base, nodeid);
+	shortage_update();
+
+	return 0;
 }
 
 vm_page_t *
 vmp_paddr_to_page(paddr_t paddr)
 {
 	kassert(paddr % PGSIZE == 0);
-	kassert(paddr / PGSIZE < SOFT_NPAGES);
-	return &mypages[paddr / PGSIZE];
+	kassert(paddr / PGSIZE < SOFT_npages);
+	return vmp_pfn_to_page(paddr / PGSIZE);
 }
 
 #define MDL_SIZE(NPAGES) (sizeof(vm_mdl_t) + sizeof(vm_page_t *) * NPAGES)
@@ -222,15 +1292,159 @@ vm_mdl_alloc(vm_mdl_t **out, size_t npages)
 	*out = mdl;
 }
 
+/*! Most pages a batched release keeps locked before queueing them. */
+#define RELEASE_BATCH 32
+
+/*!
+ * Pages that lost their last reference in a batched release. They are kept
+ * locked, chained per node and destination queue, so that each chain can be
+ * spliced onto its queue with one hold of the queue's lock.
+ */
+struct release_batch {
+	size_t npages;
+	vm_page_t *pages[RELEASE_BATCH];
+	vmp_page_queue_t standby[VMP_MAX_NODES][VMP_STANDBY_PRIORITIES];
+	vmp_page_queue_t modified[VMP_MAX_NODES];
+	size_t nstandby[VMP_MAX_NODES][VMP_STANDBY_PRIORITIES];
+	size_t nmodified[VMP_MAX_NODES];
+};
+
+static void
+release_batch_init(struct release_batch *batch)
+{
+	batch->npages = 0;
+	for (unsigned i = 0; i < vmp_nnodes; i++) {
+		for (unsigned prio = 0; prio < VMP_STANDBY_PRIORITIES; prio++) {
+			vmp_pgq_init(&batch->standby[i][prio]);
+			batch->nstandby[i][prio] = 0;
+		}
+		vmp_pgq_init(&batch->modified[i]);
+		batch->nmodified[i] = 0;
+	}
+}
+
+/*! Queue and unlock all the pages gathered in a batch. */
+static void
+release_batch_flush(struct release_batch *batch)
+{
+	ipl_t ipl;
+
+	for (unsigned i = 0; i < vmp_nnodes; i++) {
+		struct vmp_node *node = &vmp_nodes[i];
+
+		size_t nstandby = 0;
+
+		for (unsigned prio = 0; prio < VMP_STANDBY_PRIORITIES; prio++)
+			nstandby += batch->nstandby[i][prio];
+
+		if (nstandby > 0) {
+			ipl = ke_spinlock_acquire(&node->standby_lock);
+			for (unsigned prio = 0; prio < VMP_STANDBY_PRIORITIES;
+			     prio++) {
+				size_t n = batch->nstandby[i][prio];
+
+				if (n == 0)
+					continue;
+				vmp_pgq_concat(&node->standby_pgq[prio],
+				    &batch->standby[i][prio]);
+				atomic_fetch_or_explicit(&node->standby_mask,
+				    1u << prio, memory_order_relaxed);
+				vmp_stat_adjust(node, nstandby_prio[prio], n);
+				batch->nstandby[i][prio] = 0;
+			}
+			vmp_stat_adjust(node, nstandby, nstandby);
+			ke_spinlock_release(&node->standby_lock, ipl);
+			vmp_stat_adjust(node, nactive, -nstandby);
+		}
+
+		if (batch->nmodified[i] > 0) {
+			ipl = ke_spinlock_acquire(&node->modified_lock);
+			vmp_pgq_concat(&node->modified_pgq,
+			    &batch->modified[i]);
+			ke_spinlock_release(&node->modified_lock, ipl);
+			vmp_stat_adjust(node, nmodified, batch->nmodified[i]);
+			vmp_stat_adjust(node, nactive, -batch->nmodified[i]);
+			batch->nmodified[i] = 0;
+		}
+	}
+
+	for (size_t i = 0; i < batch->npages; i++)
+		vmp_page_unlock(batch->pages[i]);
+	batch->npages = 0;
+}
+
+static void
+release_batch_add(struct release_batch *batch, vm_page_t *page)
+{
+	unsigned nodeid;
+	uint16_t old;
+
+	if (page_release_fast(page))
+		return;
+
+	/*
+	 * never wait for a page lock while holding others, lest whoever holds
+	 * it be waiting for one of ours.
+	 */
+	if (batch->npages > 0 && !vmp_page_trylock(page)) {
+		release_batch_flush(batch);
+		vmp_page_lock(page);
+	} else if (batch->npages == 0)
+		vmp_page_lock(page);
+
+	old = atomic_fetch_sub_explicit(&page->refcnt, 1, memory_order_release);
+	if ((old & VMP_PAGE_REFCNT_MASK) != 1) {
+		vmp_page_unlock(page);
+		return;
+	}
+
+	if (page->use == kPageUseDeleted) {
+		page_free_deleted(page);
+		return;
+	}
+
+	page_check_pageable(page);
+
+	nodeid = vmp_page_node(page)->id;
+	if (page->dirty) {
+		vmp_pgq_insert_tail(&batch->modified[nodeid], page);
+		batch->nmodified[nodeid]++;
+	} else {
+		unsigned prio = page->standby_priority;
+
+		vmp_pgq_insert_tail(&batch->standby[nodeid][prio], page);
+		batch->nstandby[nodeid][prio]++;
+	}
+
+	batch->pages[batch->npages++] = page;
+	if (batch->npages == RELEASE_BATCH)
+		release_batch_flush(batch);
+}
+
 void
 vm_mdl_release_pages(vm_mdl_t *mdl)
 {
-	for (int i = 0; i < mdl->nentries; i++) {
-		ipl_t ipl = vmp_acquire_pfn_lock();
-		vmp_page_release_locked(mdl->pages[i]);
-		vmp_release_pfn_lock(ipl);
-		mdl->pages[i] = NULL;
+	vm_mdl_release_pages_n(&mdl, 1);
+}
+
+void
+vm_mdl_release_pages_n(vm_mdl_t **mdls, size_t nmdls)
+{
+	struct release_batch batch;
+
+	release_batch_init(&batch);
+
+	for (size_t i = 0; i < nmdls; i++) {
+		vm_mdl_t *mdl = mdls[i];
+
+		for (int j = 0; j < mdl->nentries; j++) {
+			release_batch_add(&batch, mdl->pages[j]);
+			mdl->pages[j] = NULL;
+		}
 	}
+
+	release_batch_flush(&batch);
+	shortage_update();
 }
 
 static const char *
@@ -239,8 +1453,16 @@ vm_page_use_str(enum vm_page_use use)
 	switch (use) {
 	case kPageUseFree:
 		return "free";
+	case kPageUseDeleted:
+		return "deleted";
+	case kPageUseKWired:
+		return "kwired";
+	case kPageUseBalloon:
+		return "balloon";
 	case kPageUseAnonPrivate:
 		return "anon-private";
+	case kPageUseForkPage:
+		return "fork";
 	case kPageUsePML4:
 		return "PML4";
 	case kPageUsePML3:
@@ -260,31 +1482,143 @@ vm_dump_pages(void)
 	vm_page_t *page;
 
 	kprintf("Page states:\n");
-	for (pfn_t i = 0; i < SOFT_NPAGES; i++) {
-		page = &mypages[i];
-		if (mypages[i].use == kPageUseFree)
+	for (pfn_t i = 0; i < SOFT_npages; i++) {
+		if (!vmp_pfn_valid(i))
+			continue;
+		page = vmp_pfn_to_page(i);
+		if (page->use == kPageUseFree)
 			continue;
 		printf("- PFN %lu: Use %s RC %d Used-PTE %d Valid-PTE %d\n", i,
-		    vm_page_use_str(page->use), page->refcnt,
-		    page->nonzero_ptes, page->nonswap_ptes);
+		    vm_page_use_str(page->use), vmp_page_refcnt(page),
+		    vmp_page_cold(page)->nonzero_ptes,
+		    vmp_page_cold(page)->nonswap_ptes);
 	}
-	kprintf("Standby queue:\n");
-	TAILQ_FOREACH (page, &standby_pgq, queue_link) {
-		kprintf("- PFN %lu: Use %s Page %p\n", (uintptr_t)page->pfn,
-		    vm_page_use_str(page->use), page);
-	}
-	kprintf("Dirty queue:\n");
-	TAILQ_FOREACH (page, &modified_pgq, queue_link) {
-		kprintf("- PFN %lu: Use %s Page %p\n", (uintptr_t)page->pfn,
-		    vm_page_use_str(page->use), page);
+	for (unsigned i = 0; i < vmp_nnodes; i++) {
+		struct vmp_node *node = &vmp_nodes[i];
+
+		for (unsigned prio = 0; prio < VMP_STANDBY_PRIORITIES; prio++) {
+			if (vmp_pgq_empty(&node->standby_pgq[prio]))
+				continue;
+			kprintf("Node %u standby queue, priority %u:\n", i,
+			    prio);
+			VMP_PGQ_FOREACH (page, &node->standby_pgq[prio]) {
+				kprintf("- PFN %lu: Use %s Page %p\n",
+				    (uintptr_t)page->pfn,
+				    vm_page_use_str(page->use), page);
+			}
+		}
+		kprintf("Node %u dirty queue:\n", i);
+		VMP_PGQ_FOREACH (page, &node->modified_pgq) {
+			kprintf("- PFN %lu: Use %s Page %p\n",
+			    (uintptr_t)page->pfn, vm_page_use_str(page->use),
+			    page);
+		}
 	}
 }
 
+static void
+dump_stat(const char *name, struct vm_stat *stat)
+{
+	kprintf("%-9s%-9zu%-9zu%-9zu%-9zu%-9zu\n", name, stat->nactive,
+	    stat->nmodified, stat->nstandby, stat->nfree, stat->nzeroed);
+}
+
 void
 vm_dump_page_summary(void)
 {
-	kprintf("\033[7m%-9s%-9s%-9s%-9s\033[m\n", "act", "mod", "stby",
-	    "free");
-	kprintf("%-9zu%-9zu%-9zu%-9zu\n", vmstat.nactive, vmstat.nmodified,
-	    vmstat.nstandby, vmstat.nfree);
+	struct vm_stat stat;
+
+	vm_stat_snapshot(&stat, -1);
+
+	kprintf("\033[7m%-9s%-9s%-9s%-9s%-9s%-9s\033[m\n", "", "act", "mod",
+	    "stby", "free", "zero");
+	dump_stat("total", &stat);
+
+	kprintf("\033[7m%-9s", "prio");
+	for (unsigned prio = 0; prio < VMP_STANDBY_PRIORITIES; prio++)
+		kprintf("%-9u", prio);
+	kprintf("\033[m\n%-9s", "stby");
+	for (unsigned prio = 0; prio < VMP_STANDBY_PRIORITIES; prio++)
+		kprintf("%-9zu", stat.nstandby_prio[prio]);
+	kprintf("\n%-9s", "stolen");
+	for (unsigned prio = 0; prio < VMP_STANDBY_PRIORITIES; prio++)
+		kprintf("%-9zu", stat.nrepurposed[prio]);
+	kprintf("\n");
+
+	kprintf("Large pages: %zu mapped, %zu split\n", stat.nlarge,
+	    stat.nlarge_split);
+	kprintf("Zero page: %zu reads mapped\n", stat.nzero_page_mapped);
+	kprintf("Page tables: %zu evicted, %zu reused, %zu paged out, "
+	    "%zu paged in\n", stat.ntable_evicted, stat.ntable_reused,
+	    stat.ntable_paged_out, stat.ntable_paged_in);
+	kprintf("Compaction: %zu runs, %zu pages moved, %zu.%03zu ms\n",
+	    stat.ncompact_runs, stat.ncompact_moved,
+	    stat.compact_ns / 1000000, stat.compact_ns / 1000 % 1000);
+	kprintf("Merging: %zu pages scanned, %zu merged, %zu unmerged, "
+		"%zu shared pages\n",
+	    stat.nmerge_scanned, stat.nmerged, stat.nunmerged,
+	    stat.nuse[kPageUseForkPage]);
+	kprintf("Compressed store: %zu pages in %zu KiB, %zu stored, "
+		"%zu loaded, %zu written back, %zu rejected\n",
+	    stat.cstore_pages, stat.cstore_bytes / 1024, stat.ncstore_stored,
+	    stat.ncstore_loaded, stat.ncstore_written, stat.ncstore_rejected);
+	kprintf("Balloon: %zu of %zu pages held, %zu taken, %zu given back, "
+		"%zu stalls\n",
+	    stat.nuse[kPageUseBalloon], vm_balloon_target(),
+	    stat.nballoon_inflated, stat.nballoon_deflated,
+	    stat.nballoon_stalls);
+
+	kprintf("Pages by use:");
+	for (enum vm_page_use use = 0; use <= kPageUsePML4; use++)
+		if (stat.nuse[use] != 0)
+			kprintf(" %s %zu", vm_page_use_str(use), stat.nuse[use]);
+	kprintf("\n");
+
+	kprintf("\033[7m%-9s%-9s%-9s%-9s%-9s%-9s%-9s%-9s\033[m\n", "",
+	    "zero", "trans", "swap", "busy", "valid", "pageout", "zerodrop");
+	kprintf("%-9s%-9zu%-9zu%-9zu%-9zu%-9zu%-9zu%-9zu\n", "faults",
+	    stat.nfault[kPTEKindZero], stat.nfault[kPTEKindTrans],
+	    stat.nfault[kPTEKindSwap], stat.nfault[kPTEKindBusy],
+	    stat.nfault[kPTEKindValid], stat.npageout, stat.npageout_zero);
+
+	if (vmp_nnodes == 1)
+		return;
+
+	for (unsigned i = 0; i < vmp_nnodes; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "node%u", i);
+		vm_stat_snapshot(&stat, i);
+		dump_stat(name, &stat);
+	}
+
+	kprintf("\033[7m%-9s%-18s%-18s\033[m\n", "", "local-acc", "remote-acc");
+	for (unsigned i = 0; i < vmp_nnodes; i++)
+		kprintf("node%-5u%-18zu%-18zu\n", i,
+		    (size_t)vmp_nodes[i].naccess_local,
+		    (size_t)vmp_nodes[i].naccess_remote);
+
+	if (nfast_nodes == vmp_nnodes)
+		return;
+
+	kprintf("\033[7m%-9s%-9s%-9s%-9s%-9s%-12s\033[m\n", "", "resident",
+	    "promoted", "demoted", "accesses", "cost-us");
+	for (enum vmp_tier tier = 0; tier < VMP_NTIERS; tier++) {
+		size_t resident = 0, npromoted = 0, ndemoted = 0, naccess = 0,
+		       cost_ns = 0;
+
+		for (unsigned i = 0; i < vmp_nnodes; i++) {
+			if (vmp_nodes[i].tier != tier)
+				continue;
+			vm_stat_snapshot(&stat, i);
+			resident += stat.ntotal - stat.nfree - stat.nzeroed;
+			npromoted += stat.npromoted;
+			ndemoted += stat.ndemoted;
+			naccess += vmp_nodes[i].naccess_target;
+			cost_ns += vmp_nodes[i].access_cost_ns;
+		}
+
+		kprintf("%-9s%-9zu%-9zu%-9zu%-9zu%-12zu\n",
+		    tier == kVMPTierFast ? "fast" : "slow", resident, npromoted,
+		    ndemoted, naccess, cost_ns / 1000);
+	}
 }
@@ -0,0 +1,172 @@
+/*!
+ * @file stat.c
+ * @brief VMM statistics.
+ *
+ * Updates go to a per-CPU (here, per-thread) shard of deltas, which only its
+ * own CPU writes, and are folded into the node and global counters when a
+ * delta passes a threshold. The folded counters are what the VMM reads for its
+ * decisions; they can be out by up to the threshold per CPU, which is scaled to
+ * memory size and is zero on small machines.
+ *
+ * vm_stat_snapshot() gets exact values by adding up the folded counters and
+ * every shard's deltas. Each shard has a sequence count which its CPU makes
+ * odd while it folds, so that a snapshot racing with a fold, which would see
+ * a delta counted in both places or in neither, can tell and retry.
+ */
+
+#include <sys/param.h>
+
+#include <kdk/libkern.h>
+#include <kdk/nanokern.h>
+#include <string.h>
+
+#include "vmp.h"
+
+/*! Largest fold threshold; bounds the error in the folded counters. */
+#define FOLD_THRESHOLD_MAX 64
+
+struct vmp_stat_shard {
+	struct vmp_stat_shard *next;
+	/*! Odd while a fold is in progress. */
+	atomic_uint seq;
+	_Atomic ssize_t delta[VMP_MAX_NODES][VMP_STAT_NCOUNTERS];
+};
+
+/*! All shards; they are never freed, so it may be walked without locking. */
+static _Atomic(struct vmp_stat_shard *) shards;
+static __thread struct vmp_stat_shard *this_shard;
+/*! Largest delta a shard may hold in one counter before folding it. */
+static ssize_t fold_threshold;
+
+void
+vmp_stat_init(size_t npages)
+{
+	fold_threshold = MIN(FOLD_THRESHOLD_MAX, npages / 8192);
+}
+
+static struct vmp_stat_shard *
+shard_get(void)
+{
+	struct vmp_stat_shard *shard = this_shard;
+
+	if (shard == NULL) {
+		shard = kmem_alloc(sizeof(*shard));
+		memset(shard, 0, sizeof(*shard));
+		shard->next = atomic_load_explicit(&shards,
+		    memory_order_relaxed);
+		while (!atomic_compare_exchange_weak_explicit(&shards,
+		    &shard->next, shard, memory_order_release,
+		    memory_order_relaxed))
+			;
+		this_shard = shard;
+	}
+
+	return shard;
+}
+
+void
+vmp_stat_add(struct vmp_node *node, size_t index, ssize_t delta)
+{
+	struct vmp_stat_shard *shard = shard_get();
+	_Atomic ssize_t *slot = &shard->delta[node->id][index];
+	ssize_t value;
+	unsigned seq;
+
+	/* only this CPU writes the shard, so no atomic RMW is needed */
+	value = atomic_load_explicit(slot, memory_order_relaxed) + delta;
+	if (value >= -fold_threshold && value <= fold_threshold) {
+		atomic_store_explicit(slot, value, memory_order_relaxed);
+		return;
+	}
+
+	seq = atomic_load_explicit(&shard->seq, memory_order_relaxed);
+	atomic_store_explicit(&shard->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	atomic_fetch_add_explicit(&node->stat.counter[index], value,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&vmstat.counter[index], value,
+	    memory_order_relaxed);
+	atomic_store_explicit(slot, 0, memory_order_relaxed);
+
+	atomic_store_explicit(&shard->seq, seq + 2, memory_order_release);
+}
+
+/*!
+ * Sum the sequence counts of the shards from \p head on, or return 1 (which
+ * no sum of even counts can be) if any shard is mid-fold. Sequence counts only
+ * go up, so an unchanged sum means no shard folded in the meantime.
+ */
+static unsigned
+shards_seq(struct vmp_stat_shard *head)
+{
+	unsigned sum = 0;
+
+	for (struct vmp_stat_shard *shard = head; shard != NULL;
+	     shard = shard->next) {
+		unsigned seq = atomic_load_explicit(&shard->seq,
+		    memory_order_acquire);
+		if (seq & 1)
+			return 1;
+		sum += seq;
+	}
+
+	return sum;
+}
+
+/*!
+ * Add up \p folded and the shards' deltas for nodes \p first to \p last into
+ * \p out. Returns false if a shard folded meanwhile, so the sum can't be used.
+ * Shards which appear after we start can't have folded anything we counted.
+ */
+static bool
+snapshot_try(struct vm_stat *out, struct vmp_stat *folded, unsigned first,
+    unsigned last)
+{
+	size_t *counters = (size_t *)out;
+	struct vmp_stat_shard *head;
+	unsigned seq;
+
+	head = atomic_load_explicit(&shards, memory_order_acquire);
+	seq = shards_seq(head);
+	if (seq == 1)
+		return false;
+
+	for (size_t i = 0; i < VMP_STAT_NCOUNTERS; i++) {
+		ssize_t value = atomic_load_explicit(&folded->counter[i],
+		    memory_order_relaxed);
+
+		for (struct vmp_stat_shard *shard = head; shard != NULL;
+		     shard = shard->next)
+			for (unsigned n = first; n <= last; n++)
+				value += atomic_load_explicit(
+				    &shard->delta[n][i], memory_order_relaxed);
+
+		counters[i] = value;
+	}
+
+	atomic_thread_fence(memory_order_acquire);
+
+	return shards_seq(head) == seq;
+}
+
+void
+vm_stat_snapshot(struct vm_stat *out, int nodeid)
+{
+	struct vmp_stat *folded;
+	unsigned first, last;
+
+	kassert(nodeid == -1 || (nodeid >= 0 && (unsigned)nodeid < vmp_nnodes));
+
+	if (nodeid == -1) {
+		folded = &vmstat;
+		first = 0;
+		last = vmp_nnodes - 1;
+	} else {
+		folded = &vmp_nodes[nodeid].stat;
+		first = last = nodeid;
+	}
+
+	while (!snapshot_try(out, folded, first, last))
+		;
+}
@@ -1,4 +1,5 @@
 #include <kdk/executive.h>
+#include <kdk/io.h>
 #include <string.h>
 
 #include "vmp.h"
@@ -13,78 +14,98 @@ void
 vmp_pagetable_page_nonswap_pte_created(eprocess_t *ps, vm_page_t *page,
     bool is_new)
 {
+	vm_page_cold_t *cold = vmp_page_cold(page);
+
+	vmp_page_lock(page);
+	kassert(vmp_page_refcnt(page) > 0);
 	vmp_page_retain_locked(page);
 	if (is_new)
-		page->nonzero_ptes++;
-	if (page->nonswap_ptes++ == 0 && !page_is_root_table(page)) {
+		cold->nonzero_ptes++;
+	if (cold->nonswap_ptes++ == 0 && !page_is_root_table(page)) {
 		vmp_wsl_lock_entry(ps, P2V(vmp_page_paddr(page)));
 	}
+	vmp_page_unlock(page);
 }
 
 void
 vmp_pagetable_page_pte_became_swap(eprocess_t *ps, vm_page_t *page)
 {
-	if (page->nonswap_ptes-- == 1 && !page_is_root_table(page))
+	vmp_page_lock(page);
+	if (vmp_page_cold(page)->nonswap_ptes-- == 1 &&
+	    !page_is_root_table(page))
 		vmp_wsl_unlock_entry(ps, P2V(vmp_page_paddr(page)));
-	vmp_page_release_locked(page);
+	vmp_page_unlock(page);
+	vmp_page_release(page);
 }
 
 static void vmp_md_delete_table_pointers(struct eprocess *ps,
     vm_page_t *dirpage, pte_t *dirpte);
 
-/*!
- * @brief Update pagetable page after PTE(s) made zero within it.
- *
- * This will amend the PFNDB entry's nonswap and nonzero PTE count, and if the
- * new nonzero PTE count is zero, delete the page. If the new nonswap PTE count
- * is zero, the page will be unlocked from its owning process' working set.
- *
- * @pre ps->ws_lock held
- */
-static void
+void
 vmp_pagetable_page_pte_deleted(struct eprocess *ps, vm_page_t *page,
     bool was_swap)
 {
-	if (page->nonzero_ptes-- == 1 && !page_is_root_table(page)) {
+	vm_page_cold_t *cold = vmp_page_cold(page);
+
+	vmp_page_lock(page);
+
+	if (cold->nonzero_ptes-- == 1 && !page_is_root_table(page)) {
 		vm_page_t *dirpage;
+		pte_t *dirpte;
 
-		page->use = kPageUseDeleted;
+		vmp_page_set_use(page, kPageUseDeleted);
 
-		if (page->nonswap_ptes == 1) {
+		if (cold->nonswap_ptes == 1) {
 			vmp_wsl_unlock_entry(ps, P2V(vmp_page_paddr(page)));
 			vmp_wsl_remove(ps, P2V(vmp_page_paddr(page)));
-		} else if (page->nonswap_ptes == 0)
+		} else if (cold->nonswap_ptes == 0)
 			vmp_wsl_remove(ps, P2V(vmp_page_paddr(page)));
 		else
 			kfatal("expectex nonswap_ptes to be 0 or 1\n");
 
-		dirpage = vmp_paddr_to_page(page->referent_pte);
-		vmp_md_delete_table_pointers(ps, dirpage,
-		    (pte_t *)P2V(page->referent_pte));
+		dirpage = vmp_paddr_to_page(
+		    (cold->referent_pte / PGSIZE) * PGSIZE);
+		dirpte = (pte_t *)P2V(cold->referent_pte);
 
-		page->nonswap_ptes = 0;
-		page->referent_pte = 0;
+		cold->nonswap_ptes = 0;
+		cold->referent_pte = 0;
+		/* any copy left in the pagefile from paging it in is stale */
+		vmp_drumslot_free(cold->drumslot);
+		cold->drumslot = -1;
+
+		/* nothing can find the page now; the directory takes its lock */
+		vmp_page_unlock(page);
+		vmp_md_delete_table_pointers(ps, dirpage, dirpte);
 
 		/*! once for the working set removal.... */
-		vmp_page_release_locked(page);
+		vmp_page_release(page);
 		/*! and once for the PTE zeroing; this will free the page. */
-		vmp_page_release_locked(page);
+		vmp_page_release(page);
 
 		return;
 	}
-	if (!was_swap && page->nonswap_ptes-- == 1 &&
+	if (!was_swap && cold->nonswap_ptes-- == 1 &&
 	    !page_is_root_table(page)) {
 		vmp_wsl_unlock_entry(ps, P2V(vmp_page_paddr(page)));
 	}
-	vmp_page_release_locked(page);
+	vmp_page_unlock(page);
+	vmp_page_release(page);
 }
 
-/*! @brief Convert the PTEs pointing to page table \p dirpage to trans PTEs. */
 void
 vmp_md_transition_table_pointers(struct eprocess *ps, vm_page_t *dirpage,
     vm_page_t *tablepage)
 {
-	kfatal("Implement me!\n");
+	vm_page_cold_t *cold = vmp_page_cold(tablepage);
+	pte_t *dirpte = (pte_t *)P2V(cold->referent_pte);
+
+	kassert(vmp_paddr_to_page((cold->referent_pte / PGSIZE) * PGSIZE) ==
+	    dirpage);
+	kassert(vmp_pte_characterise(dirpte) == kPTEKindValid &&
+	    vmp_pte_hw_pfn(dirpte, 2) == tablepage->pfn);
+
+	/* (TLBs would be shot down here.) */
+	vmp_pte_trans_create(dirpte, tablepage->pfn);
 }
 
 static void
@@ -105,9 +126,118 @@ vmp_md_setup_table_pointers(struct eprocess *ps, vm_page_t *dirpage,
 	vmp_pte_hw_create(dirpte, tablepage->pfn, true);
 }
 
-static void
+vm_page_t *
+vmp_md_split_large_pte(struct eprocess *ps, pte_t *pte)
+{
+	vm_page_t *page = vmp_pte_hw_page(pte, VMP_LARGE_PAGE_LEVEL);
+	bool writeable = vmp_pte_hw_is_writeable(pte);
+	vm_page_t *table;
+	vm_page_cold_t *cold;
+	pte_t *ptes;
+
+	kassert(vmp_pte_hw_is_large(pte));
+
+	vmp_page_alloc(&table, kPageUsePML1, true);
+	ptes = (pte_t *)P2V(vmp_page_paddr(table));
+
+	/* the table is ours alone yet; one reference per nonswap PTE */
+	cold = vmp_page_cold(table);
+	cold->process = ps;
+	cold->referent_pte = V2P(pte);
+	cold->nonzero_ptes = VMP_LARGE_PAGE_PAGES;
+	cold->nonswap_ptes = VMP_LARGE_PAGE_PAGES;
+	atomic_fetch_add_explicit(&table->refcnt, VMP_LARGE_PAGE_PAGES,
+	    memory_order_relaxed);
+
+	for (size_t i = 0; i < VMP_LARGE_PAGE_PAGES; i++) {
+		vmp_pte_hw_create(&ptes[i], page[i].pfn, writeable);
+		vmp_page_cold(&page[i])->referent_pte = V2P(&ptes[i]);
+	}
+
+	/*
+	 * the directory's counts stay as they were: the large PTE counted as
+	 * a nonswap PTE just as the table pointer replacing it does.
+	 */
+	vmp_pte_hw_create(pte, table->pfn, true);
+	vmp_wsl_insert(ps, P2V(vmp_page_paddr(table)), true, true);
+
+	vmp_stat_adjust(vmp_page_node(page), nlarge, -1);
+	vmp_stat_adjust(vmp_page_node(page), nlarge_split, 1);
+
+	return table;
+}
+
+void
 vmp_pager_state_release(vmp_pager_state_t *state)
 {
+	if (--state->refcount == 0)
+		kmem_free(state, sizeof(*state));
+}
+
+/*!
+ * Read page table \p page back in from \p drumslot, through the busy PTE
+ * \p dirpte. The WS lock is dropped for the read; anyone else walking through
+ * \p dirpte meanwhile waits on the pager state, which is freed when they have
+ * all seen it signalled.
+ *
+ * The table's PTEs were all swap or zero PTEs when it was written (only such
+ * tables are evicted), so its nonzero PTE count is made again from them.
+ */
+static void
+table_swap_in(eprocess_t *ps, vm_page_t *page, pte_t *dirpte,
+    uintptr_t drumslot) LOCK_REQUIRES(ps->ws_lock)
+{
+	vm_page_cold_t *cold = vmp_page_cold(page);
+	vmp_pager_state_t *state;
+	pte_t *ptes;
+	vm_mdl_t *mdl;
+	iop_t iop;
+
+	state = vmp_pager_state_alloc();
+	vm_mdl_alloc(&mdl, 1);
+	kassert(state != NULL);
+	kassert(mdl != NULL);
+
+	vmp_pte_busy_create(dirpte, state);
+	ke_mutex_release(&ps->ws_lock);
+
+	mdl->offset = 0;
+	mdl->nentries = 1;
+	mdl->pages[0] = page;
+
+	ke_event_init(&iop.event, false);
+	iop_init_vnode_read(&iop, vmp_pagefile.vnode, mdl, PGSIZE,
+	    drumslot * PGSIZE);
+	iop_send(&iop);
+	ke_event_wait(&iop.event, -1);
+	kmem_free(mdl, sizeof(*mdl) + sizeof(vm_page_t *));
+
+	ke_wait(&ps->ws_lock, "table_swap_in: reacquire ws_lock", false, false,
+	    -1);
+
+	ptes = (pte_t *)P2V(vmp_page_paddr(page));
+	cold->nonzero_ptes = 0;
+	cold->nonswap_ptes = 0;
+	for (size_t i = 0; i < PGSIZE / sizeof(pte_t); i++) {
+		switch (vmp_pte_characterise(&ptes[i])) {
+		case kPTEKindZero:
+			break;
+
+		case kPTEKindSwap:
+			cold->nonzero_ptes++;
+			break;
+
+		default:
+			kfatal("Nonswap PTE in a table read from the pagefile\n");
+		}
+	}
+	kassert(cold->nonzero_ptes > 0);
+
+	/* waiters took references of their own */
+	ke_event_signal(&state->event);
+	vmp_pager_state_release(state);
+
+	vmp_stat_adjust(vmp_page_node(page), ntable_paged_in, 1);
 }
 
 void
@@ -122,22 +252,33 @@ vmp_pte_wire_state_release(struct vmp_pte_wire_state *state)
 }
 
 /*!
- * Note: WS lock and PFN lock will be locked and unlocked regularly here.
+ * Note: WS lock will be locked and unlocked regularly here.
+ *
+ * Walking through valid table PTEs needs only the WS lock and the lock of each
+ * table page in turn: the tables are already active, so they are retained
+ * without touching any page queue.
+ *
  * \pre VAD list mutex held
  */
 int
 vmp_wire_pte(eprocess_t *ps, vaddr_t vaddr, struct vmp_pte_wire_state *state)
 {
-	ipl_t ipl;
+	return vmp_wire_pte_level(ps, vaddr, 1, state);
+}
+
+int
+vmp_wire_pte_level(eprocess_t *ps, vaddr_t vaddr, int leaf_level,
+    struct vmp_pte_wire_state *state)
+{
 	int indexes[VMP_TABLE_LEVELS + 1];
 	vm_page_t *pages[VMP_TABLE_LEVELS] = { 0 };
+	vm_page_t *new_tables[VMP_TABLE_LEVELS];
+	int nnew_tables = 0;
 	pte_t *table;
 
 	vmp_addr_unpack(vaddr, indexes);
 	state->ps = ps;
 
-	ipl = vmp_acquire_pfn_lock();
-
 	/*
 	 * start by pinning root table with a valid-pte reference, to keep it
 	 * locked in the working set. this same approach is used through the
@@ -157,10 +298,9 @@ vmp_wire_pte(eprocess_t *ps, vaddr_t vaddr, struct vmp_pte_wire_state *state)
 
 		/* note - level is 1-based */
 
-		if (level == 1) {
+		if (level == leaf_level) {
 			memcpy(state->pages, pages, sizeof(pages));
 			state->pte = pte;
-			vmp_release_pfn_lock(ipl);
 			return 0;
 		}
 
@@ -173,6 +313,7 @@ vmp_wire_pte(eprocess_t *ps, vaddr_t vaddr, struct vmp_pte_wire_state *state)
 		switch (vmp_pte_characterise(pte)) {
 		case kPTEKindValid: {
 			vm_page_t *page = vmp_pte_hw_page(pte, level);
+			kassert(!vmp_pte_hw_is_large(pte));
 			pages[level - 2] = page;
 			vmp_pagetable_page_nonswap_pte_created(ps, page, true);
 			table = (pte_t *)P2V(vmp_pte_hw_paddr(pte, level));
@@ -182,57 +323,119 @@ vmp_wire_pte(eprocess_t *ps, vaddr_t vaddr, struct vmp_pte_wire_state *state)
 		case kPTEKindTrans: {
 			paddr_t next_table_p = vmp_pfn_to_paddr(pte->trans.pfn);
 			vm_page_t *page = vmp_paddr_to_page(next_table_p);
-			/* retain for our wiring purposes */
+
+			vmp_page_lock(page);
+			if (vmp_pte_characterise(pte) != kPTEKindTrans ||
+			    pte->trans.pfn != page->pfn) {
+				/* changed while we waited for the page lock */
+				vmp_page_unlock(page);
+				goto restart_level;
+			}
+
+			/*
+			 * the table was evicted; reactivating it takes it off
+			 * the standby list, and gives back the working set its
+			 * reference.
+			 */
 			pages[level - 2] = vmp_page_retain_locked(page);
+			vmp_page_cold(page)->reused = true;
+			vmp_stat_adjust(vmp_page_node(page), ntable_reused, 1);
 
-			/* manually adjust the page */
+			/* manually adjust the page for our wiring purposes */
 			vmp_page_retain_locked(page);
-			page->nonzero_ptes++;
-			page->nonswap_ptes++;
+			vmp_page_cold(page)->nonzero_ptes++;
+			vmp_page_cold(page)->nonswap_ptes++;
+			vmp_page_unlock(page);
 			vmp_wsl_insert(ps, P2V(next_table_p), true, true);
 
-			vmp_md_setup_table_pointers(ps, pages[level - 1], page,
-			    pte, false);
+			/*
+			 * the directory counted the trans PTE as nonswap
+			 * already, so its counts stay as they are.
+			 */
+			vmp_pte_hw_create(pte, page->pfn, true);
 
 			table = (pte_t *)P2V(vmp_pte_hw_paddr(pte, level));
 			break;
 		}
 
 		case kPTEKindBusy: {
-			vm_page_t *page = vmp_pte_hw_page(pte, level);
-			vmp_pager_state_t *state = page->pager_state;
+			/* the table is being read in; wait for it to be */
+			vmp_pager_state_t *state = vmp_pte_busy_state(pte);
 			state->refcount++;
-			vmp_release_pfn_lock(ipl);
 			ke_mutex_release(&ps->ws_lock);
 			ke_event_wait(&state->event, -1);
-			vmp_pager_state_release(state);
 			ke_wait(&ps->ws_lock, "vmp_wire_pte: reacquire ws_lock",
 			    false, false, -1);
-			ipl = vmp_acquire_pfn_lock();
+			vmp_pager_state_release(state);
 			goto restart_level;
 		}
 
-		case kPTEKindSwap:
-			kfatal("swap page back in\n");
+		case kPTEKindSwap: {
+			uintptr_t drumslot = vmp_pte_swap_drumslot(pte);
+			vm_page_t *page;
+			vm_page_cold_t *cold;
+
+			/* only tables written to the pagefile are stolen */
+			kassert(drumslot != -1 &&
+			    !vmp_drumslot_is_cstore(drumslot));
+
+			/* newly-allocated page is retained, as for zero PTEs */
+			if (vmp_page_alloc(&page, kPageUsePML1 + (level - 2),
+				false) != 0)
+				goto fail;
+			cold = vmp_page_cold(page);
+			cold->process = ps;
+			cold->referent_pte = V2P(pte);
+			cold->drumslot = drumslot;
+
+			/* the busy PTE keeps the directory in the working set */
+			vmp_pagetable_page_nonswap_pte_created(ps,
+			    pages[level - 1], false);
+			table_swap_in(ps, page, pte, drumslot);
+
+			pages[level - 2] = page;
+
+			/* manually adjust the page; it is ours alone yet */
+			vmp_page_retain(page);
+			cold->nonzero_ptes++;
+			cold->nonswap_ptes++;
+			vmp_wsl_insert(ps, P2V(vmp_page_paddr(page)), true, true);
+
+			/* the directory counted the busy PTE already */
+			vmp_pte_hw_create(pte, page->pfn, true);
+
+			table = (pte_t *)P2V(vmp_pte_hw_paddr(pte, level));
 			break;
+		}
 
 		case kPTEKindZero: {
 			vm_page_t *page;
-			int r;
+			vm_page_cold_t *cold;
+
+			/*
+			 * every level below a zero PTE needs a new table too,
+			 * so allocate them all at once the first time.
+			 */
+			if (nnew_tables == 0) {
+				nnew_tables = level - leaf_level;
+				if (vmp_page_alloc_batch(kPageUsePML1,
+					nnew_tables, new_tables) != 0)
+					goto fail;
+			}
 
 			/* newly-allocated page is retained */
-			r = vmp_page_alloc_locked(&page,
-			    kPageUsePML1 + (level - 2), false);
-			kassert(r == 0);
+			page = new_tables[--nnew_tables];
+			vmp_page_set_use(page, kPageUsePML1 + (level - 2));
 
 			pages[level - 2] = page;
 
-			/* manually adjust the new page */
-			vmp_page_retain_locked(page);
-			page->process = ps;
-			page->nonzero_ptes++;
-			page->nonswap_ptes++;
-			page->referent_pte = V2P(pte);
+			/* manually adjust the new page; it is ours alone yet */
+			vmp_page_retain(page);
+			cold = vmp_page_cold(page);
+			cold->process = ps;
+			cold->nonzero_ptes++;
+			cold->nonswap_ptes++;
+			cold->referent_pte = V2P(pte);
 			vmp_wsl_insert(ps, P2V(vmp_page_paddr(page)), true, true);
 
 			vmp_md_setup_table_pointers(ps, pages[level - 1], page,
@@ -244,12 +447,24 @@ vmp_wire_pte(eprocess_t *ps, vaddr_t vaddr, struct vmp_pte_wire_state *state)
 		}
 	}
 	kfatal("unreached\n");
+
+fail:
+	/* unwire the tables above; the fault waits for pages and retries */
+	memcpy(state->pages, pages, sizeof(pages));
+	vmp_pte_wire_state_release(state);
+	return -1;
 }
 
 int
 vmp_fetch_pte(eprocess_t *ps, vaddr_t vaddr, pte_t **pte_out)
 {
-	ipl_t ipl;
+	return vmp_fetch_pte_level(ps, vaddr, 1, pte_out);
+}
+
+int
+vmp_fetch_pte_level(eprocess_t *ps, vaddr_t vaddr, int leaf_level,
+    pte_t **pte_out)
+{
 	int indexes[VMP_TABLE_LEVELS + 1];
 	pte_t *table;
 
@@ -262,12 +477,13 @@ vmp_fetch_pte(eprocess_t *ps, vaddr_t vaddr, pte_t **pte_out)
 
 		/* note - level is 1-based */
 
-		if (level == 1) {
+		if (level == leaf_level) {
 			*pte_out = pte;
 			return 0;
 		}
 
-		if (vmp_pte_characterise(pte) != kPTEKindValid)
+		if (vmp_pte_characterise(pte) != kPTEKindValid ||
+		    vmp_pte_hw_is_large(pte))
 			return -1;
 
 		table = (pte_t *)P2V(vmp_pte_hw_paddr(pte, level));
@@ -0,0 +1,165 @@
+/*!
+ * @file tier.c
+ * @brief The tier migrator moves hot pages into the fast tier of physical
+ * memory and cold ones out of it.
+ *
+ * Nodes are either in the fast tier or the slow (see enum vmp_tier), and pages
+ * are allocated from the fast tier while it has free pages. Which pages are
+ * being used is told by sampling the accessed bits of the working set's PTEs
+ * now and then: each sample raises the heat of a page found accessed and
+ * halves that of one found not (see vmp_wsl_sample().) Pages in the slow tier
+ * which have got hot are promoted, and to make room for them, and to keep
+ * some of the fast tier free for new allocations, pages in the fast tier that
+ * have gone cold are demoted.
+ *
+ * Only anonymous pages mapped by small PTEs are moved. Large pages are left
+ * where they are, as are page tables, which the MMU's walks touch but which
+ * have no accessed bit of their own here.
+ */
+
+#include <kdk/executive.h>
+#include <kdk/libkern.h>
+#include <kdk/nanokern.h>
+
+#include "vmp.h"
+
+/*! Most pages promoted, and most demoted, per sample. */
+#define TIER_BATCH 32
+
+kevent_t vmp_tier_event;
+
+/*! Pages picked out by a sample. */
+struct tier_sample {
+	vm_page_t *hot[TIER_BATCH], *cold[TIER_BATCH];
+	size_t nhot, ncold;
+};
+
+/*! Where vmp_migrate_page() is to move pages to, and what it was given. */
+struct tier_dest {
+	enum vmp_tier tier;
+	vm_page_t *page;
+};
+
+static void
+sample_page(void *arg, __attribute__((unused)) vaddr_t vaddr, vm_page_t *page,
+    unsigned heat)
+{
+	struct tier_sample *sample = arg;
+
+	if (page->use != kPageUseAnonPrivate)
+		return;
+
+	if (vmp_page_node(page)->tier == kVMPTierSlow) {
+		if (heat >= vmparam.tier_promote_heat &&
+		    sample->nhot < TIER_BATCH)
+			sample->hot[sample->nhot++] = page;
+	} else if (heat == 0 && sample->ncold < TIER_BATCH) {
+		sample->cold[sample->ncold++] = page;
+	}
+}
+
+/*!
+ * Take a free page from any node of the destination's tier, unless free pages
+ * are down to the reserve kept for allocations.
+ */
+static vm_page_t *
+tier_page_take(void *arg)
+{
+	struct tier_dest *dest = arg;
+	vm_page_t *page = NULL;
+
+	/* the page moved from is only freed once the move is done */
+	if (vmp_page_shortage()) {
+		dest->page = NULL;
+		return NULL;
+	}
+
+	for (unsigned i = 0; i < vmp_nnodes && page == NULL; i++) {
+		struct vmp_node *node = &vmp_nodes[i];
+		ipl_t ipl;
+
+		if (node->tier != dest->tier)
+			continue;
+
+		ipl = ke_spinlock_acquire(&node->free_lock);
+		page = vmp_buddy_alloc(node, 0);
+		ke_spinlock_release(&node->free_lock, ipl);
+	}
+
+	dest->page = page;
+	return page;
+}
+
+/*! Get the count of free pages in the fast tier. */
+static size_t
+fast_free_pages(void)
+{
+	size_t nfree = 0;
+
+	for (unsigned i = 0; i < vmp_nnodes; i++)
+		if (vmp_nodes[i].tier == kVMPTierFast)
+			nfree += vmp_stat_read(&vmp_nodes[i].stat, nfree) +
+			    vmp_stat_read(&vmp_nodes[i].stat, nzeroed);
+
+	return nfree;
+}
+
+void *
+vmp_tier_migrator(void *)
+{
+	struct tier_sample sample;
+	struct tier_dest dest;
+	size_t fast_free;
+	bool have_slow = false;
+
+	for (unsigned i = 0; i < vmp_nnodes; i++)
+		have_slow |= vmp_nodes[i].tier == kVMPTierSlow;
+	if (!have_slow)
+		return NULL;
+
+loop:
+	ke_event_wait(&vmp_tier_event, vmparam.tier_scan_ns);
+	ke_event_clear(&vmp_tier_event);
+
+	sample.nhot = sample.ncold = 0;
+	ke_wait(&kernel_ps.ws_lock, "vmp_tier_migrator:ps->ws_lock", false,
+	    false, -1);
+	vmp_wsl_sample(&kernel_ps, sample_page, &sample);
+	ke_mutex_release(&kernel_ps.ws_lock);
+
+	/*
+	 * the pages may have been trimmed or freed, and even reallocated, since;
+	 * vmp_migrate_page() only tries their locks, and checks they are still
+	 * what they were before moving them.
+	 */
+	fast_free = fast_free_pages();
+
+	/* make room for the promotions, keeping the target free besides */
+	dest.tier = kVMPTierSlow;
+	for (size_t i = 0; i < sample.ncold &&
+	     fast_free < vmparam.tier_fast_free_target + sample.nhot;
+	     i++) {
+		int r = vmp_migrate_page(sample.cold[i], tier_page_take, &dest);
+		if (r < 0)
+			break;
+		else if (r == 0) {
+			vmp_stat_adjust(vmp_page_node(dest.page), ndemoted, 1);
+			fast_free++;
+		}
+	}
+
+	dest.tier = kVMPTierFast;
+	for (size_t i = 0; i < sample.nhot &&
+	     fast_free > vmparam.tier_fast_free_target;
+	     i++) {
+		int r = vmp_migrate_page(sample.hot[i], tier_page_take, &dest);
+		if (r < 0)
+			break;
+		else if (r == 0) {
+			vmp_stat_adjust(vmp_page_node(dest.page), npromoted, 1);
+			fast_free--;
+		}
+	}
+
+	goto loop;
+}
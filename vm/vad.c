@@ -61,6 +61,8 @@ vm_ps_map_section_view(eprocess_t *ps, void *section, vaddr_t *vaddrp,
 	vad->flags.writeable = initial_writeability;
 	vad->flags.max_protection = max_writeability;
 	vad->section = section;
+	vad->numa_policy = kNUMAPolicyFirstTouch;
+	vad->numa_node = 0;
 
 	RB_INSERT(vm_vad_rbtree, &ps->vad_tree, vad);
 
@@ -70,3 +72,54 @@ vm_ps_map_section_view(eprocess_t *ps, void *section, vaddr_t *vaddrp,
 
 	return 0;
 }
+
+int
+vm_ps_set_numa_policy(eprocess_t *ps, vaddr_t vaddr, enum vm_numa_policy policy,
+    unsigned node)
+{
+	vm_vad_t *vad;
+	int r = 0;
+
+	if (policy == kNUMAPolicyPreferred && node >= vmp_nnodes)
+		return -1;
+
+	ke_wait(&ps->vad_lock, "set_numa_policy:ps->vad_lock", false, false,
+	    -1);
+
+	vad = vmp_ps_vad_find(ps, vaddr);
+	if (vad == NULL) {
+		r = -1;
+	} else {
+		vad->numa_policy = policy;
+		vad->numa_node = node;
+	}
+
+	ke_mutex_release(&ps->vad_lock);
+
+	return r;
+}
+
+unsigned
+vmp_vad_node(vm_vad_t *vad, vaddr_t vaddr)
+{
+	switch (vad->numa_policy) {
+	case kNUMAPolicyPreferred:
+		return vad->numa_node;
+
+	case kNUMAPolicyInterleave: {
+		enum vmp_tier tier = vmp_nodes[vmp_current_node()].tier;
+		unsigned ntier = 0, k;
+
+		for (unsigned i = 0; i < vmp_nnodes; i++)
+			ntier += vmp_nodes[i].tier == tier;
+
+		k = ((vaddr - vad->start) / PGSIZE) % ntier;
+		for (unsigned i = 0;; i++)
+			if (vmp_nodes[i].tier == tier && k-- == 0)
+				return i;
+	}
+
+	default:
+		return vmp_current_node();
+	}
+}
@@ -4,16 +4,315 @@
 #include <kdk/defs.h>
 #include <kdk/queue.h>
 #include <kdk/tree.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
 #include "vmpsoft.h"
 
-typedef TAILQ_HEAD(vmp_page_queue, vm_page) vmp_page_queue_t;
+/*! Pages in a section of physical memory, as a shift. */
+#define VMP_SECTION_SHIFT 10
+#define VMP_SECTION_PAGES ((pfn_t)1 << VMP_SECTION_SHIFT)
 
-struct vm_stat {
-	size_t nfree, nmodified, nstandby, nactive;
-	size_t ntotal;
+/*!
+ * A section of the physical address space. The PFN database is kept per
+ * section, and only for sections where there is memory, so that holes in
+ * physical memory cost nothing; see vm_page_hot_add().
+ *
+ * A section, once present, is never removed, so its entry may be read without
+ * locking.
+ */
+struct vmp_section {
+	/*! The section's PFN database, hot and cold; NULL if absent. */
+	vm_page_t *pages;
+	vm_page_cold_t *cold;
+	/*! Pages present, from the start of the section. */
+	uint32_t npages;
+	/*! NUMA node the section's memory belongs to. */
+	uint32_t node;
+};
+
+/*! Sections of the physical address space, present or not. */
+extern struct vmp_section *vmp_sections;
+extern size_t vmp_nsections;
+
+/* struct vmp_section *vmp_pfn_section(pfn_t pfn) */
+#define vmp_pfn_section(PFN) (&vmp_sections[(PFN) >> VMP_SECTION_SHIFT])
+
+/* vm_page_t *vmp_pfn_to_page(pfn_t pfn) */
+#define vmp_pfn_to_page(PFN) \
+	(&vmp_pfn_section(PFN)->pages[(PFN) & (VMP_SECTION_PAGES - 1)])
+
+/* vm_page_cold_t *vmp_page_cold(vm_page_t *page) */
+#define vmp_page_cold(PAGE) \
+	(&vmp_pfn_section((PAGE)->pfn)->cold[(PAGE)->pfn & \
+	    (VMP_SECTION_PAGES - 1)])
+
+/*! @brief Whether there is memory at \p pfn. */
+static inline bool
+vmp_pfn_valid(pfn_t pfn)
+{
+	return (pfn >> VMP_SECTION_SHIFT) < vmp_nsections &&
+	    (pfn & (VMP_SECTION_PAGES - 1)) < vmp_pfn_section(pfn)->npages;
+}
+
+/*! Page lock bit in vm_page_t.refcnt. */
+#define VMP_PAGE_LOCKED 0x8000
+/*! Reference count bits in vm_page_t.refcnt. */
+#define VMP_PAGE_REFCNT_MASK 0x7fff
+
+/*! @brief Get the reference count of a page. */
+static inline uint16_t
+vmp_page_refcnt(vm_page_t *page)
+{
+	return atomic_load_explicit(&page->refcnt, memory_order_relaxed) &
+	    VMP_PAGE_REFCNT_MASK;
+}
+
+/*! @brief Try to lock a page without waiting; true if it was locked. */
+static inline bool
+vmp_page_trylock(vm_page_t *page)
+{
+	uint16_t old = atomic_load_explicit(&page->refcnt, memory_order_relaxed);
+
+	while (!(old & VMP_PAGE_LOCKED)) {
+		if (atomic_compare_exchange_weak_explicit(&page->refcnt, &old,
+			old | VMP_PAGE_LOCKED, memory_order_acquire,
+			memory_order_relaxed))
+			return true;
+	}
+
+	return false;
+}
+
+/*! @brief Lock a page. Page locks are held only briefly; this spins. */
+static inline void
+vmp_page_lock(vm_page_t *page)
+{
+	while (!vmp_page_trylock(page))
+		;
+}
+
+static inline void
+vmp_page_unlock(vm_page_t *page)
+{
+	atomic_fetch_and_explicit(&page->refcnt, (uint16_t)~VMP_PAGE_LOCKED,
+	    memory_order_release);
+}
+
+static inline bool
+vmp_page_is_locked(vm_page_t *page)
+{
+	return atomic_load_explicit(&page->refcnt, memory_order_relaxed) &
+	    VMP_PAGE_LOCKED;
+}
+
+/*! Null link in a page queue. */
+#define VMP_PGQ_NONE UINT32_MAX
+
+/*!
+ * Doubly-linked queue of pages. The links are 32-bit PFNs rather than
+ * pointers, to keep the PFN database entries small.
+ */
+typedef struct vmp_page_queue {
+	uint32_t head, tail;
+} vmp_page_queue_t;
+
+#define VMP_PGQ_INITIALIZER { VMP_PGQ_NONE, VMP_PGQ_NONE }
+
+static inline vm_page_t *
+vmp_pgq_page(uint32_t pfn)
+{
+	return pfn == VMP_PGQ_NONE ? NULL : vmp_pfn_to_page(pfn);
+}
+
+static inline void
+vmp_pgq_init(vmp_page_queue_t *queue)
+{
+	queue->head = queue->tail = VMP_PGQ_NONE;
+}
+
+static inline bool
+vmp_pgq_empty(vmp_page_queue_t *queue)
+{
+	return queue->head == VMP_PGQ_NONE;
+}
+
+static inline vm_page_t *
+vmp_pgq_first(vmp_page_queue_t *queue)
+{
+	return vmp_pgq_page(queue->head);
+}
+
+static inline vm_page_t *
+vmp_pgq_next(vm_page_t *page)
+{
+	return vmp_pgq_page(page->queue_next);
+}
+
+static inline void
+vmp_pgq_insert_head(vmp_page_queue_t *queue, vm_page_t *page)
+{
+	page->queue_prev = VMP_PGQ_NONE;
+	page->queue_next = queue->head;
+	if (queue->head == VMP_PGQ_NONE)
+		queue->tail = page->pfn;
+	else
+		vmp_pfn_to_page(queue->head)->queue_prev = page->pfn;
+	queue->head = page->pfn;
+}
+
+static inline void
+vmp_pgq_insert_tail(vmp_page_queue_t *queue, vm_page_t *page)
+{
+	page->queue_next = VMP_PGQ_NONE;
+	page->queue_prev = queue->tail;
+	if (queue->tail == VMP_PGQ_NONE)
+		queue->head = page->pfn;
+	else
+		vmp_pfn_to_page(queue->tail)->queue_next = page->pfn;
+	queue->tail = page->pfn;
+}
+
+static inline void
+vmp_pgq_remove(vmp_page_queue_t *queue, vm_page_t *page)
+{
+	if (page->queue_next == VMP_PGQ_NONE)
+		queue->tail = page->queue_prev;
+	else
+		vmp_pfn_to_page(page->queue_next)->queue_prev =
+		    page->queue_prev;
+	if (page->queue_prev == VMP_PGQ_NONE)
+		queue->head = page->queue_next;
+	else
+		vmp_pfn_to_page(page->queue_prev)->queue_next =
+		    page->queue_next;
+}
+
+/*! Put \p new in the place of \p old, which is on \p queue. */
+static inline void
+vmp_pgq_replace(vmp_page_queue_t *queue, vm_page_t *old, vm_page_t *new)
+{
+	new->queue_next = old->queue_next;
+	new->queue_prev = old->queue_prev;
+	if (old->queue_next == VMP_PGQ_NONE)
+		queue->tail = new->pfn;
+	else
+		vmp_pfn_to_page(old->queue_next)->queue_prev = new->pfn;
+	if (old->queue_prev == VMP_PGQ_NONE)
+		queue->head = new->pfn;
+	else
+		vmp_pfn_to_page(old->queue_prev)->queue_next = new->pfn;
+}
+
+/*! Move all of the pages on \p src to the tail of \p dst. */
+static inline void
+vmp_pgq_concat(vmp_page_queue_t *dst, vmp_page_queue_t *src)
+{
+	if (src->head == VMP_PGQ_NONE)
+		return;
+	if (dst->head == VMP_PGQ_NONE) {
+		dst->head = src->head;
+	} else {
+		vmp_pfn_to_page(dst->tail)->queue_next = src->head;
+		vmp_pfn_to_page(src->head)->queue_prev = dst->tail;
+	}
+	dst->tail = src->tail;
+	vmp_pgq_init(src);
+}
+
+#define VMP_PGQ_FOREACH(PAGE, QUEUE) \
+	for ((PAGE) = vmp_pgq_first(QUEUE); (PAGE) != NULL; \
+	     (PAGE) = vmp_pgq_next(PAGE))
+
+/*! Number of buddy allocator orders; the largest block is 2^(n-1) pages. */
+#define VMP_BUDDY_ORDERS 11
+_Static_assert(VMP_BUDDY_ORDERS - 1 <= VMP_SECTION_SHIFT,
+    "buddy blocks must not span sections");
+
+/*! Most simulated NUMA nodes the physical arena can be split into. */
+#define VMP_MAX_NODES 8
+
+/*!
+ * Physical memory tiers. Each node is in one; slow nodes stand for memory
+ * such as CXL-attached DRAM, which is larger but further away than the fast.
+ */
+enum vmp_tier {
+	kVMPTierFast,
+	kVMPTierSlow,
+};
+
+#define VMP_NTIERS 2
+
+/*! Most heat a working set list entry can have; see vmp_wsl_sample(). */
+#define VMP_WSLE_HEAT_MAX 7
+
+/*! Standby priority of pages trimmed from a process of default priority. */
+#define VMP_STANDBY_PRIORITY_DEFAULT 5
+
+/*! Number of counters in a struct vm_stat. */
+#define VMP_STAT_NCOUNTERS (sizeof(struct vm_stat) / sizeof(size_t))
+/*! Index of a struct vm_stat field among its counters. */
+#define VMP_STAT_INDEX(FIELD) (offsetof(struct vm_stat, FIELD) / sizeof(size_t))
+
+/*!
+ * Folded statistics counters, laid out as a struct vm_stat. Updates collect in
+ * per-CPU shards first and are only folded in here once they pass a threshold
+ * (see vm/stat.c), so these are close to, but not exactly, the true values;
+ * vm_stat_snapshot() gets those. Read with vmp_stat_read().
+ */
+struct vmp_stat {
+	atomic_size_t counter[VMP_STAT_NCOUNTERS];
+};
+
+/*!
+ * A (simulated) NUMA node: a contiguous range of physical memory with its own
+ * free, zeroed, standby and modified queues and page counts.
+ *
+ * Locking: there is no global PFN lock. Each queue has its own lock, and a
+ * page's state (reference count transitions and queue membership, use, dirty
+ * bit, cold fields, and the PTE referring to it while it is inactive) is
+ * guarded by the page lock (see vmp_page_lock()). The order is:
+ *
+ *	ps->ws_lock
+ *	  page lock (a data page before the table page mapping it, and a table
+ *	  page before its directory page)
+ *	    ps->wsl_lock
+ *	    standby_lock / modified_lock
+ *	      magazine lock
+ *	        free_lock
+ *
+ * Queue locks are never held while waiting for a page lock; code that finds a
+ * page on a queue and wants to lock it must use vmp_page_trylock().
+ */
+struct vmp_node {
+	unsigned id;
+	enum vmp_tier tier;
+	/*!
+	 * The PFNs the node's sections lie within. Not all of them need be the
+	 * node's or be present; check with vmp_pfn_valid() and the section.
+	 */
+	pfn_t base_pfn;
+	size_t npages;
+	/*! Guards free_area and zero_pgq. */
+	kspinlock_t free_lock;
+	/*! Guards standby_pgq and standby_mask. */
+	kspinlock_t standby_lock;
+	/*! Guards modified_pgq. */
+	kspinlock_t modified_lock;
+	/*! Buddy free lists, see resident.c. */
+	vmp_page_queue_t free_area[VMP_BUDDY_ORDERS];
+	vmp_page_queue_t zero_pgq, modified_pgq;
+	/*! Standby lists, by standby priority. */
+	vmp_page_queue_t standby_pgq[VMP_STANDBY_PRIORITIES];
+	/*! Bit n set if standby_pgq[n] is nonempty; may be read unlocked. */
+	atomic_uint standby_mask;
+	/*! This node's share of vmstat. */
+	struct vmp_stat stat;
+	/*! Simulated MMU accesses by CPUs of this node to local/remote memory. */
+	atomic_size_t naccess_local, naccess_remote;
+	/*! Simulated MMU accesses to this node's memory, and latency they cost. */
+	atomic_size_t naccess_target, access_cost_ns;
 };
 
 struct vm_param {
@@ -23,6 +322,22 @@ struct vm_param {
 	size_t min_avail_for_expansion;
 	/*! minimum available pages for regular allocations */
 	size_t min_avail_for_alloc;
+	/*! number of zeroed pages the zeroer tries to keep on hand */
+	size_t zeroed_target;
+	/*! buddy order the compactor tries to assemble free blocks of */
+	unsigned compact_order;
+	/*! fragmentation index (per mille) above which a node is compacted */
+	unsigned compact_threshold;
+	/*! nanoseconds between the tier migrator's accessed-bit samples */
+	int64_t tier_scan_ns;
+	/*! heat at which a slow tier page is promoted to the fast tier */
+	unsigned tier_promote_heat;
+	/*! free pages the tier migrator keeps in the fast tier, by demoting */
+	size_t tier_fast_free_target;
+	/*! nanoseconds between the page merger's scans */
+	int64_t merge_scan_ns;
+	/*! pages the page merger looks at in each scan; 0 stops it */
+	size_t merge_scan_pages;
 };
 
 struct vmp_pte_wire_state {
@@ -36,9 +351,16 @@ typedef struct vmp_pager_state {
 	kevent_t event;
 } vmp_pager_state_t;
 
+/*! Gives a free page to move a page into, for vmp_migrate_page(). */
+typedef vm_page_t *(*vmp_migrate_dest_t)(void *arg);
+
 struct vmp_forkpage {
 	pte_t pte;
 	uint32_t refcount;
+	/*! Hash of the page's contents, for finding it to merge pages into. */
+	uint64_t hash;
+	/*! Entry in the merge index, see vm/merge.c. */
+	LIST_ENTRY(vmp_forkpage) hash_link;
 };
 
 typedef struct vm_section {
@@ -64,9 +386,15 @@ typedef struct vm_vad {
 	vaddr_t start, end;
 	/*! Section object; only set if flags.private = false */
 	vm_section_t *section;
+	/*! NUMA placement policy for pages of the VAD */
+	enum vm_numa_policy numa_policy;
+	/*! node for kNUMAPolicyPreferred */
+	unsigned numa_node;
 } vm_vad_t;
 
 typedef struct vmp_pagefile {
+	/*! Guards the slot bitmap and counts. */
+	kspinlock_t lock;
 	vnode_t *vnode;
 	uint8_t *bitmap;
 	size_t total_slots;
@@ -74,93 +402,398 @@ typedef struct vmp_pagefile {
 	size_t next_free;
 } vmp_pagefile_t;
 
-int vmp_page_alloc_locked(vm_page_t **out, enum vm_page_use use, bool must);
-vm_page_t *vmp_page_retain_locked(vm_page_t *page);
-void vmp_page_release_locked(vm_page_t *page);
+/*! @brief Allocate a pagefile slot; returns -1 if there are none free. */
+uintptr_t vmp_pagefile_alloc(vmp_pagefile_t *pf);
+/*! @brief Free a pagefile slot. -1, for no slot, is ignored. */
+void vmp_pagefile_free(vmp_pagefile_t *pf, uintptr_t slot);
+/*!
+ * @brief Free a page's backing copy: a pagefile slot or compressed store entry.
+ * -1, for none, is ignored.
+ */
+void vmp_drumslot_free(uintptr_t drumslot);
+
+/*!
+ * @brief Reserve \p npages pages for the compressed store; none leaves it off.
+ * Must be called after the pagefile is set up and vmparam filled in. Fatal if
+ * too little memory would be left for the system to run in.
+ */
+void vmp_cstore_init(size_t npages);
+/*!
+ * @brief Compress a page into the compressed store. Returns a drumslot naming
+ * the entry, or -1 if the page compresses too poorly or the store is full.
+ *
+ * @pre Page locked.
+ */
+uintptr_t vmp_cstore_put(vm_page_t *page);
+/*!
+ * @brief Load and free the compressed store entry \p handle. Returns 0 if its
+ * contents were put into \p page; or 1 if it had been written to the pagefile,
+ * in which case \p drumslot is set to the slot to read.
+ */
+int vmp_cstore_load(uintptr_t handle, vm_page_t *page, uintptr_t *drumslot);
+/*! @brief Free a compressed store entry without loading it. */
+void vmp_cstore_free(uintptr_t handle);
+/*!
+ * @brief Write the oldest entries of the compressed store to the pagefile if
+ * it is getting full. Called by the page writer.
+ *
+ * @pre No page or queue locks held.
+ */
+void vmp_cstore_writeback(void);
+
+/*!
+ * @brief Take pages for the memory balloon if it is short of its target,
+ * trimming working sets if none are to be had. Called by the balancer.
+ * Returns whether it took any and the balloon is still short, so that another
+ * pass straight away is worthwhile.
+ *
+ * @pre No page or queue locks held.
+ */
+bool vmp_balloon_inflate(void);
+
+/*!
+ * @brief Allocate a zeroed page.
+ *
+ * Zeroed pages are preferred; if none are available, a free or standby page is
+ * taken and cleared.
+ *
+ * @pre No page or queue locks held.
+ */
+int vmp_page_alloc(vm_page_t **out, enum vm_page_use use, bool must);
+/*!
+ * @brief Allocate a zeroed page, preferably from NUMA node \p nodeid.
+ *
+ * vmp_page_alloc() is this with the current CPU's node. Other nodes are tried
+ * in turn if the preferred one has no free pages.
+ *
+ * @pre No page or queue locks held.
+ */
+int vmp_page_alloc_node(vm_page_t **out, unsigned nodeid,
+    enum vm_page_use use, bool must);
+/*!
+ * @brief Allocate \p npages zeroed pages at once, into \p out.
+ *
+ * This does one shortage check for the whole batch and takes each node's
+ * queues' locks once rather than once per page. It is all or nothing: if the
+ * batch can't be satisfied in full, any pages gathered are given back and -1
+ * is returned. Pages come from the current CPU's node where possible.
+ *
+ * @pre No page or queue locks held.
+ */
+int vmp_page_alloc_batch(enum vm_page_use use, size_t npages,
+    vm_page_t **out);
+/*!
+ * @brief Allocate 2^order physically contiguous, naturally aligned zeroed
+ * pages.
+ *
+ * Each page of the run is set up and retained as vmp_page_alloc() would set up
+ * a single page, and they are released individually; freed pages coalesce back
+ * into larger blocks in the buddy allocator.
+ *
+ * @pre No page or queue locks held.
+ */
+int vmp_page_alloc_order(vm_page_t **out, unsigned order,
+    enum vm_page_use use, bool must);
+/*!
+ * @brief Allocate 2^order contiguous pages, preferably from NUMA node
+ * \p nodeid; vmp_page_alloc_order() is this with the current CPU's node.
+ */
+int vmp_page_alloc_order_node(vm_page_t **out, unsigned nodeid,
+    unsigned order, enum vm_page_use use, bool must);
+/*!
+ * @brief Take a free block of 2^order pages from the buddy allocator.
+ *
+ * This is the raw allocator: no accounting is done, and the pages are not set
+ * up for use.
+ *
+ * @pre Node's free lock held
+ */
+vm_page_t *vmp_buddy_alloc(struct vmp_node *node, unsigned order)
+    LOCK_REQUIRES(node->free_lock);
+/*!
+ * @brief Take the free page \p pfn out of the buddy allocator, splitting the
+ * free block it lies in. Returns NULL if the page is not free in the buddy
+ * allocator, or if its block is of order \p max_order or more. No accounting is
+ * done.
+ *
+ * @pre Node's free lock held
+ */
+vm_page_t *vmp_buddy_alloc_pfn(struct vmp_node *node, pfn_t pfn,
+    unsigned max_order) LOCK_REQUIRES(node->free_lock);
+/*!
+ * @brief Give a block of 2^order free pages back to the buddy allocator,
+ * coalescing it with its free buddies. No accounting is done.
+ *
+ * @pre Free lock of the page's node held
+ */
+void vmp_buddy_free(vm_page_t *page, unsigned order)
+    LOCK_REQUIRES(vmp_page_node(page)->free_lock);
+/*!
+ * @brief Give every cached free page (in the magazines and on the zeroed
+ * queues) back to the buddy allocator so it can coalesce, for when contiguous
+ * pages are wanted. This throws away zeroing work.
+ *
+ * @pre No page or queue locks held.
+ */
+void vmp_free_caches_reclaim(void);
+/*!
+ * @brief Ask the compactor to assemble free blocks of 2^order pages on NUMA
+ * node \p nodeid, after a contiguous allocation failed for want of one.
+ */
+void vmp_compact_request(unsigned nodeid, unsigned order);
+/*!
+ * @brief Move an anonymous private page or leaf page table into a free page
+ * got from \p dest, which is called with page locks held and must not block.
+ *
+ * \p dest takes a page straight from the buddy allocator, without accounting;
+ * it may be on another node. Returns 0 if the page was moved, 1 if it can't be
+ * just now, and -1 if \p dest gave no page.
+ *
+ * \p page need not be referenced by the caller: it may be free, or be freed
+ * and allocated again meanwhile. Its lock is only tried, which the allocators
+ * allow for, and what it is used for is seen to with it held.
+ *
+ * @pre No page or queue locks held.
+ */
+int vmp_migrate_page(vm_page_t *page, vmp_migrate_dest_t dest, void *arg);
+/*!
+ * @brief Handle a write fault on a merged page, mapped read-only by \p pte, by
+ * giving the faulting mapping a private copy of it (or the page itself, if no
+ * other mapping shares it.) The PTE is made writeable, and \p page_out set to
+ * the page it now maps.
+ *
+ * Returns 0, or -1 if no page could be had for the copy.
+ */
+int vmp_merge_break(struct eprocess *ps, vm_vad_t *vad, vaddr_t vaddr,
+    pte_t *pte, vm_page_t **page_out) LOCK_REQUIRES(ps->ws_lock);
+/*!
+ * @brief Retain a page, moving it off the standby or modified queue if it was
+ * inactive.
+ *
+ * @pre Page locked
+ */
+vm_page_t *vmp_page_retain_locked(vm_page_t *page) LOCK_REQUIRES(page);
+/*!
+ * @brief Release a page, putting it on the standby or modified queue if that
+ * was the last reference. Deleted pages must be released with
+ * vmp_page_release() instead, since freeing them drops the page lock.
+ *
+ * @pre Page locked
+ */
+void vmp_page_release_locked(vm_page_t *page) LOCK_REQUIRES(page);
+/*!
+ * @brief Retain a page without its lock held.
+ *
+ * If the page is already active, only the reference count changes and this is
+ * done atomically without locking; the page lock is only taken for the 0->1
+ * transition, which moves the page off its queue. A caller holding the page
+ * lock uses vmp_page_retain_locked() instead.
+ */
+vm_page_t *vmp_page_retain(vm_page_t *page) LOCK_EXCLUDES(page);
+/*!
+ * @brief Release a page without its lock held.
+ *
+ * Like vmp_page_retain(), the page lock is only taken for the 1->0 transition,
+ * which queues or frees the page.
+ */
+void vmp_page_release(vm_page_t *page) LOCK_EXCLUDES(page);
 vm_page_t *vmp_paddr_to_page(paddr_t paddr);
+/*! @brief Get the NUMA node a page belongs to. */
+struct vmp_node *vmp_page_node(vm_page_t *page);
+
+/*! @brief Set up statistics for a machine of \p npages pages. */
+void vmp_stat_init(size_t npages);
+/*!
+ * @brief Add \p delta to counter \p index of \p node's and the global stats.
+ * Use vmp_stat_adjust() rather than calling this directly.
+ */
+void vmp_stat_add(struct vmp_node *node, size_t index, ssize_t delta);
 
 /*!
  * @brief Insert one entry into a working set list.
  *
  * n.b. Page should be REFERENCED - this effectively consumes that reference.
  *
- * @pre PFNDB lock held
  * @pre WS lock held
+ * @pre No page locks held (the working set may be trimmed to make room.)
  */
 void vmp_wsl_insert(struct eprocess *ps, vaddr_t vaddr, bool is_pagetable, bool locked)
-    LOCK_REQUIRES(ps->ws_lock) LOCK_REQUIRES(pfn_lock);
+    LOCK_REQUIRES(ps->ws_lock);
 /*!
  * @brief Remove one entry from a working set list.
  *
- * @pre PFNDB lock held
  * @pre WS lock held
  */
 void vmp_wsl_remove(struct eprocess *ps, vaddr_t vaddr)
-    LOCK_REQUIRES(ps->ws_lock) LOCK_REQUIRES(pfn_lock);
+    LOCK_REQUIRES(ps->ws_lock);
+/*!
+ * @brief Change the address of a working set list entry, keeping its place in
+ * the list; for a page table which has moved in physical memory.
+ *
+ * @pre WS lock held
+ */
+void vmp_wsl_rename(struct eprocess *ps, vaddr_t vaddr, vaddr_t new_vaddr)
+    LOCK_REQUIRES(ps->ws_lock);
 /*!
  * @brief Lock an existing entry into a working set list.
- * @pre WS lock held.
+ * @pre WS lock held, or the lock of the page the entry maps.
  */
 void vmp_wsl_lock_entry(struct eprocess *ps, vaddr_t vaddr)
-    LOCK_REQUIRES(ps->ws_lock);
+    LOCK_EXCLUDES(ps->wsl_lock);
 /*!
  * @brief Unlock a locked entry from a working set list.
- * @pre WS lock held.
+ * @pre WS lock held, or the lock of the page the entry maps.
  */
 void vmp_wsl_unlock_entry(struct eprocess *ps, vaddr_t vaddr)
+    LOCK_EXCLUDES(ps->wsl_lock);
+
+int vmp_wsl_trim_n(struct eprocess *ps, size_t count)
+    LOCK_REQUIRES(ps->ws_lock);
+/*!
+ * @brief Sample and clear the accessed bits of a working set's small pages,
+ * calling \p fn for each with its updated heat.
+ *
+ * An entry's heat goes up by one each sample its page was accessed since the
+ * last, to at most VMP_WSLE_HEAT_MAX, and halves each sample it was not. \p fn
+ * is called with the WS lock held, and must not take it or the WSL lock.
+ */
+void vmp_wsl_sample(struct eprocess *ps,
+    void (*fn)(void *arg, vaddr_t vaddr, vm_page_t *page, unsigned heat),
+    void *arg) LOCK_REQUIRES(ps->ws_lock) LOCK_EXCLUDES(ps->wsl_lock);
+/*!
+ * @brief Find the first working set list entry for a small page at or after
+ * \p *vaddr, and set \p *vaddr to its address. Returns -1 if there is none.
+ */
+int vmp_wsl_next(struct eprocess *ps, vaddr_t *vaddr)
     LOCK_REQUIRES(ps->ws_lock);
 
-int vmp_wsl_trim_n(struct eprocess *ps, size_t count) LOCK_REQUIRES(ps->ws_lock)
-    LOCK_EXCLUDES(vmp_pfn_lock);
+/*!
+ * @brief Insert a working set list entry for a large page.
+ *
+ * This counts as VMP_LARGE_PAGE_PAGES entries against the working set's size.
+ * Unlike vmp_wsl_insert(), it can fail, if not enough entries can be trimmed.
+ *
+ * @pre WS lock held
+ * @pre No page locks held
+ */
+int vmp_wsl_insert_large(struct eprocess *ps, vaddr_t vaddr)
+    LOCK_REQUIRES(ps->ws_lock);
 
 /*!
- * @brief Wire a PTE.
+ * @brief Wire a PTE. Returns -1, having wired nothing, if a page table needed
+ * on the way couldn't be allocated.
  * @pre WS lock held. (May be dropped and reacquired!)
  */
 int vmp_wire_pte(struct eprocess *, vaddr_t, struct vmp_pte_wire_state *);
+/*!
+ * @brief Wire the PTE at \p level (1 being the leaf tables) for a virtual
+ * address. Only the tables above that level are wired. Fails as
+ * vmp_wire_pte() does.
+ * @pre WS lock held. (May be dropped and reacquired!)
+ */
+int vmp_wire_pte_level(struct eprocess *, vaddr_t, int level,
+    struct vmp_pte_wire_state *);
 /*!
  * @brief Release locked PTE state.
  */
 void vmp_pte_wire_state_release(struct vmp_pte_wire_state *);
+/*! @brief Allocate pager state for a busy PTE, holding one reference. */
+struct vmp_pager_state *vmp_pager_state_alloc(void);
+/*!
+ * @brief Drop a reference to the pager state of a busy PTE, freeing it with
+ * the last.
+ * @pre WS lock of the process whose PTE it was held.
+ */
+void vmp_pager_state_release(struct vmp_pager_state *state);
 /*!
  * @brief Get pointer to an in-memory PTE.
  * n.b. does not wire anything, should only be called when the PTE is stable
  * (due to being kernel wired memory or otherwise certain to be in-memory, etc.)
  */
 int vmp_fetch_pte(struct eprocess *ps, vaddr_t vaddr, pte_t **pte_out);
+/*! @brief Get pointer to an in-memory PTE at \p level; see vmp_fetch_pte(). */
+int vmp_fetch_pte_level(struct eprocess *ps, vaddr_t vaddr, int level,
+    pte_t **pte_out);
+/*!
+ * @brief Split a large page mapping into a new PML1 table of small PTEs to the
+ * same pages, which goes into the working set. Returns the new table.
+ *
+ * @pre WS lock held
+ */
+vm_page_t *vmp_md_split_large_pte(struct eprocess *ps, pte_t *pte)
+    LOCK_REQUIRES(ps->ws_lock);
 
 /*!
  * @brief Update pagetable page after nonswap PTE(s) created within it.
  *
  * This will amend the PFNDB entry's nonswap PTE count, and if the previous
- * nonswap PTE count was 0, lock the page into the working set.
+ * nonswap PTE count was 0, lock the page into the working set. The counts are
+ * guarded by the page's lock, which this takes.
+ *
+ * The page must already be active (it is in the working set or wired.)
  *
  * @param is_new Whether the nonswap PTE is brand new (replacing a zero PTE; if
  * so, used_ptes count must be increased as well as nonswap_ptes.)
  */
 void vmp_pagetable_page_nonswap_pte_created(struct eprocess *ps,
     vm_page_t *page, bool is_new) LOCK_REQUIRES(ps->ws_lock)
-    LOCK_REQUIRES(pfn_lock);
+    LOCK_EXCLUDES(page);
 
-/*! @brief Convert the PTEs pointing to page table \p dirpage to trans PTEs. */
+/*!
+ * @brief Convert the PTE in directory \p dirpage pointing to page table
+ * \p tablepage to a trans PTE, as the table is evicted. The directory's counts
+ * stay as they were: a trans PTE keeps the directory in core as a valid one
+ * does, since the table's referent PTE is there.
+ *
+ * @pre WS lock held, \p tablepage locked.
+ */
 void vmp_md_transition_table_pointers(struct eprocess *ps, vm_page_t *dirpage,
-    vm_page_t *tablepage);
+    vm_page_t *tablepage) LOCK_REQUIRES(ps->ws_lock) LOCK_REQUIRES(tablepage);
 
 /*!
  * @brief Update pagetable page after nonswap PTE became swap.
  *
  * This will amend the PFNDB entry's nonswap PTE count, and if the nonswap PTE
  * count reaches 0, unlock the page from the the working set.
+ *
+ * This is called when stealing a page, without the WS lock; the caller holds
+ * the lock of the page that the PTE referred to instead.
  */
 void vmp_pagetable_page_pte_became_swap(struct eprocess *ps, vm_page_t *page)
-    LOCK_REQUIRES(ps->ws_lock) LOCK_REQUIRES(pfn_lock);
+    LOCK_EXCLUDES(page);
+
+/*!
+ * @brief Update pagetable page after PTE(s) made zero within it.
+ *
+ * This will amend the PFNDB entry's nonswap and nonzero PTE count, and if the
+ * new nonzero PTE count is zero, delete the page. If the new nonswap PTE count
+ * is zero, the page will be unlocked from its owning process' working set.
+ *
+ * @param was_swap Whether the PTE made zero was a swap PTE.
+ */
+void vmp_pagetable_page_pte_deleted(struct eprocess *ps, vm_page_t *page,
+    bool was_swap) LOCK_REQUIRES(ps->ws_lock) LOCK_EXCLUDES(page);
 
 vm_vad_t *vmp_ps_vad_find(struct eprocess *ps, vaddr_t vaddr);
+/*!
+ * @brief Get the NUMA node to allocate the page at \p vaddr in \p vad from.
+ * Interleaving is over the nodes of the current node's tier only, so that an
+ * interleaved region doesn't go to slow memory from the first.
+ */
+unsigned vmp_vad_node(vm_vad_t *vad, vaddr_t vaddr);
 int vm_ps_allocate(struct eprocess *ps, vaddr_t *vaddrp, size_t size,
     bool exact);
 int vm_ps_map_section_view(struct eprocess *ps, void *section, vaddr_t *vaddrp,
     size_t size, uint64_t offset, bool initial_writeability,
     bool max_writeability, bool inherit_shared, bool cow, bool exact);
+/*!
+ * @brief Set the NUMA placement policy of the mapping containing \p vaddr.
+ * Pages already resident stay where they are.
+ *
+ * @param node Node to prefer; only meaningful with kNUMAPolicyPreferred.
+ */
+int vm_ps_set_numa_policy(struct eprocess *ps, vaddr_t vaddr,
+    enum vm_numa_policy policy, unsigned node);
 
 /* paddr_t vmp_page_paddr(vm_page_t *page) */
 #define vmp_page_paddr(PAGE) ((paddr_t)(PAGE)->pfn << VMP_PAGE_SHIFT)
@@ -183,26 +816,112 @@ int vm_ps_map_section_view(struct eprocess *ps, void *section, vaddr_t *vaddrp,
 /* vm_page_t *vmp_pte_trans_page(pte_t *pte) */
 #define vmp_pte_trans_page(PTE) vmp_paddr_to_page(vmp_pte_trans_paddr(PTE))
 
-/* ipl_t vmp_acquire_pfn_lock(void) */
-#define vmp_acquire_pfn_lock() ke_spinlock_acquire(&vmp_pfn_lock);
+/* unsigned vmp_current_node(void) */
+#define vmp_current_node() (SIM_node)
 
-/* void vmp_release_pfn_lock(ipl_t ipl) */
-#define vmp_release_pfn_lock(IPL) ke_spinlock_release(&vmp_pfn_lock, IPL)
+/*
+ * void vmp_stat_adjust(struct vmp_node *node, FIELD, ssize_t delta)
+ *
+ * Adjusts a statistic both for the node and in the global vmstat. FIELD names
+ * a field of struct vm_stat.
+ */
+#define vmp_stat_adjust(NODE, FIELD, DELTA) \
+	vmp_stat_add((NODE), VMP_STAT_INDEX(FIELD), (DELTA))
+
+/*
+ * size_t vmp_stat_read(struct vmp_stat *stat, FIELD)
+ *
+ * Reads the folded value of a statistic. Unfolded deltas can leave it below
+ * zero for a while, so it is clamped.
+ */
+#define vmp_stat_read(STAT, FIELD) \
+	vmp_stat_counter_read(&(STAT)->counter[VMP_STAT_INDEX(FIELD)])
+
+static inline size_t
+vmp_stat_counter_read(atomic_size_t *counter)
+{
+	ssize_t value = atomic_load_explicit(counter, memory_order_relaxed);
+	return value < 0 ? 0 : value;
+}
+
+/*! Change the use of a page, keeping the per-use page counts right. */
+static inline void
+vmp_page_set_use(vm_page_t *page, enum vm_page_use use)
+{
+	struct vmp_node *node = vmp_page_node(page);
+
+	vmp_stat_adjust(node, nuse[page->use], -1);
+	vmp_stat_adjust(node, nuse[use], 1);
+	page->use = use;
+}
+
+/* size_t vmp_free_pages(void) */
+#define vmp_free_pages() \
+	(vmp_stat_read(&vmstat, nfree) + vmp_stat_read(&vmstat, nzeroed))
+
+/* size_t vmp_avail_pages(void) */
+#define vmp_avail_pages() (vmp_free_pages() + vmp_stat_read(&vmstat, nstandby))
 
-/* bool vmp_page_shortage(void) LOCK_REQUIRES(vmp_pfn_lock) */
+/*!
+ * A set of kernels to zero, copy and test whole pages with one instruction
+ * set; each takes page-aligned addresses. zero_nt and copy_nt store around the
+ * cache, and are NULL for a set with no such stores.
+ */
+struct vmp_page_kernels {
+	const char *name;
+	/*! Whether the CPU can run these. */
+	bool (*supported)(void);
+	void (*zero)(void *page);
+	void (*zero_nt)(void *page);
+	void (*copy)(void *dst, const void *src);
+	void (*copy_nt)(void *dst, const void *src);
+	bool (*is_zero)(const void *page);
+};
+
+/*!
+ * @brief Pick the page kernels: the widest the CPU supports for non-temporal
+ * stores and zero tests, and libc's for cached stores.
+ */
+void vmp_page_kernels_init(void);
+
+/*!
+ * @brief Zero a page. If \p nontemporal, the stores go around the cache; use
+ * that when the page won't be touched again soon.
+ */
+void vmp_page_zero(vm_page_t *page, bool nontemporal);
+
+/*!
+ * @brief Copy page \p src to \p dst. If \p nontemporal, the stores to \p dst
+ * go around the cache.
+ */
+void vmp_page_copy(vm_page_t *dst, vm_page_t *src, bool nontemporal);
+
+/*! @brief Whether a page is all zeroes. */
+bool vmp_page_is_zero(vm_page_t *page);
+
+/* bool vmp_page_shortage(void) */
 #define vmp_page_shortage() \
-	((vmstat.nfree + vmstat.nstandby) <= vmparam.min_avail_for_alloc)
+	(vmp_avail_pages() <= vmparam.min_avail_for_alloc)
 
-/* bool vmp_page_sufficience(void) LOCK_REQUIRES(vmp_pfn_lock) */
+/* bool vmp_page_sufficience(void) */
 #define vmp_page_sufficience() \
-	((vmstat.nfree + vmstat.nstandby) >= (vmparam.min_avail_for_alloc * 2))
+	(vmp_avail_pages() >= (vmparam.min_avail_for_alloc * 2))
 
 extern struct vm_param vmparam;
-extern struct vm_stat vmstat;
-extern kspinlock_t vmp_pfn_lock;
+extern struct vmp_stat vmstat;
 extern kevent_t vmp_sufficient_pages_event;
-extern kevent_t vmp_pgwriter_event, vmp_balancer_event;
-extern vmp_page_queue_t free_pgq, standby_pgq, modified_pgq;
+extern kevent_t vmp_pgwriter_event, vmp_balancer_event, vmp_zeroer_event;
+extern kevent_t vmp_compact_event, vmp_tier_event, vmp_merge_event;
+extern struct vmp_node vmp_nodes[VMP_MAX_NODES];
+extern unsigned vmp_nnodes;
 extern vmp_pagefile_t vmp_pagefile;
+/*!
+ * The zero page: mapped read-only wherever anonymous memory never written is
+ * read. It is wired, and not retained for each mapping.
+ */
+extern vm_page_t *vmp_zero_page;
+/*! Page kernels for each instruction set, narrowest first. */
+extern const struct vmp_page_kernels vmp_page_kernels[];
+extern const size_t vmp_npage_kernels;
 
 #endif /* KRX_VM_VMP_H */
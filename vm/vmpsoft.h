@@ -16,6 +16,13 @@
 #define VMP_LEVEL_1_ENTRIES 512
 #define VMP_LEVEL_1_STEP 1
 
+/*! Level of the tables whose PTEs may map a large page instead of a table. */
+#define VMP_LARGE_PAGE_LEVEL 2
+/*! Buddy order of a large page, and its size in pages and bytes. */
+#define VMP_LARGE_PAGE_ORDER 9
+#define VMP_LARGE_PAGE_PAGES (1ul << VMP_LARGE_PAGE_ORDER)
+#define VMP_LARGE_PAGE_SIZE (PGSIZE << VMP_LARGE_PAGE_ORDER)
+
 
 typedef struct pte_hw {
 	bool valid : 1;
@@ -25,7 +32,8 @@ typedef struct pte_hw {
 	bool nocache : 1;
 	bool accessed : 1;
 	bool dirty : 1;
-	bool pat : 1;
+	/*! PAT in a PML1 PTE; in a PML2 PTE, maps a large page. */
+	bool large : 1;
 	bool global : 1;
 	uint64_t available1 : 3;
 	pfn_t pfn : 40;
@@ -39,6 +47,12 @@ enum vmp_soft_pte_kind {
 	kSoftPteKindTrans,
 };
 
+/*!
+ * Set in a drumslot (in a swap PTE or a page's cold part) which names an entry
+ * in the compressed store rather than a pagefile slot; see vm/cstore.c.
+ */
+#define VMP_DRUMSLOT_CSTORE ((uintptr_t)1 << 59)
+
 typedef struct pte_swap {
 	bool valid : 1;
 	uintptr_t drumslot : 61;
@@ -111,6 +125,26 @@ vmp_pte_hw_create(pte_t *pte, pfn_t pfn, bool writeable)
 	pte->u64 = newpte.u64;
 }
 
+/*! Create a PML2 PTE mapping the large page starting at \p pfn. */
+static inline void
+vmp_pte_hw_large_create(pte_t *pte, pfn_t pfn, bool writeable)
+{
+	pte_t newpte;
+	newpte.u64 = 0x0;
+	newpte.hw.valid = 1;
+	newpte.hw.writeable = writeable;
+	newpte.hw.large = 1;
+	newpte.hw.pfn = pfn;
+	pte->u64 = newpte.u64;
+}
+
+/*! Whether a valid PTE maps a large page rather than the next table. */
+static inline bool
+vmp_pte_hw_is_large(pte_t *pte)
+{
+	return pte->hw.large;
+}
+
 static inline void
 vmp_pte_zero_create(pte_t *pte)
 {
@@ -137,22 +171,60 @@ vmp_pte_busy_create(pte_t *pte, struct vmp_pager_state *state)
 	pte->u64 = newpte.u64;
 }
 
+/*!
+ * Make a swap PTE. The drumslot is kept plus one, as swap PTEs are of kind 0 and
+ * one for slot 0 would otherwise be all zeroes and taken for a zero PTE; -1, for
+ * no drumslot, is kept as all ones.
+ */
 static inline void
 vmp_pte_swap_create(pte_t *pte, uintptr_t drumslot)
 {
 	pte_t newpte;
 	newpte.swap.valid = 0;
 	newpte.swap.kind = kSoftPteKindSwap;
-	newpte.swap.drumslot = drumslot;
+	newpte.swap.drumslot = drumslot == -1 ? drumslot : drumslot + 1;
 	pte->u64 = newpte.u64;
 }
 
+/*! Get the drumslot of a swap PTE; -1 if the page had none. */
+static inline uintptr_t
+vmp_pte_swap_drumslot(pte_t *pte)
+{
+	pte_t none;
+	none.u64 = 0x0;
+	none.swap.drumslot = -1;
+	return pte->swap.drumslot == none.swap.drumslot ?
+	    (uintptr_t)-1 :
+	    (uintptr_t)pte->swap.drumslot - 1;
+}
+
+/*! Whether \p drumslot names an entry in the compressed store. */
+static inline bool
+vmp_drumslot_is_cstore(uintptr_t drumslot)
+{
+	return drumslot != -1 && (drumslot & VMP_DRUMSLOT_CSTORE) != 0;
+}
+
 static inline bool
 vmp_pte_hw_is_writeable(pte_t *pte)
 {
 	return pte->hw.writeable;
 }
 
+/*!
+ * Clear the accessed bit of a valid PTE and return whether it was set. This is
+ * done atomically, as the MMU may be setting it meanwhile.
+ */
+static inline bool
+vmp_pte_hw_test_clear_accessed(pte_t *pte)
+{
+	pte_t mask;
+	mask.u64 = 0x0;
+	mask.hw.accessed = 1;
+	return __atomic_fetch_and(&pte->u64, ~mask.u64, __ATOMIC_RELAXED) &
+	    mask.u64;
+}
+
 static inline void
 vmp_addr_unpack(vaddr_t vaddr, int unpacked[5])
 {
@@ -166,6 +238,7 @@ vmp_addr_unpack(vaddr_t vaddr, int unpacked[5])
 }
 
 /* vmp_pager_state_t *vmp_pte_busy_state(pte_t *pte) */
-#define vmp_pte_busy_state(PTE) (vmp_pager_state_t *)(pte->trans.state << 3)
+#define vmp_pte_busy_state(PTE) \
+	((vmp_pager_state_t *)((uintptr_t)(PTE)->busy.state << 3))
 
 #endif /* KRX_VM_SOFT_H */
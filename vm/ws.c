@@ -9,8 +9,14 @@ struct vmp_wsle {
 	RB_ENTRY(vmp_wsle) rb_entry;
 	vaddr_t vaddr;
 	bool is_pagetable : 1;
+	/*! Maps a large page; counts as VMP_LARGE_PAGE_PAGES entries. */
+	bool is_large : 1;
+	/*! How often the page has been found accessed lately. */
+	unsigned heat : 3;
 };
 
+#define wsle_weight(WSLE) ((WSLE)->is_large ? VMP_LARGE_PAGE_PAGES : 1)
+
 static inline intptr_t
 wsle_cmp(struct vmp_wsle *x, struct vmp_wsle *y)
 {
@@ -27,32 +33,95 @@ vmp_wsl_find(eprocess_t *ps, vaddr_t vaddr)
 	return RB_FIND(vmp_wsle_rb, &ps->wsl.tree, &key);
 }
 
+/*!
+ * Choose the standby list for a page being trimmed from \p ps. The process'
+ * page priority is the base; a page faulted back in since it was last trimmed
+ * has shown it is still in use, so it goes a list higher than pages that were
+ * only ever touched once.
+ */
+static unsigned
+trim_priority(eprocess_t *ps, vm_page_t *page) LOCK_REQUIRES(page)
+{
+	unsigned prio = ps->page_priority;
+
+	if (vmp_page_cold(page)->reused && prio < VMP_STANDBY_PRIORITIES - 1)
+		prio++;
+
+	return prio;
+}
+
 static void
 wsl_evict(eprocess_t *ps, vm_page_t *page, pte_t *pte)
 {
+	/* there is nothing to keep of a zero page mapping */
+	if (page == vmp_zero_page) {
+		vmp_pte_zero_create(pte);
+		vmp_pagetable_page_pte_deleted(ps,
+		    vmp_paddr_to_page((V2P(pte) / PGSIZE) * PGSIZE), false);
+		return;
+	}
+
 	switch (page->use) {
 	case kPageUseAnonPrivate: {
 		bool dirty = vmp_pte_hw_is_writeable(pte);
+
+		/* the page lock guards the PTE once the page can be stolen */
+		vmp_page_lock(page);
 		page->dirty |= dirty;
+		page->standby_priority = trim_priority(ps, page);
+		vmp_page_cold(page)->reused = false;
 		vmp_pte_trans_create(pte, vmp_pte_hw_pfn(pte, 1));
-		break;
+		vmp_page_release_locked(page);
+		vmp_page_unlock(page);
+		return;
 	}
 
 	case kPageUsePML1:
 	case kPageUsePML2:
-	case kPageUsePML3:
-	case kPageUsePML4: {
-		int level = page->use - (kPageUsePML1 - 1);
-		vm_page_t *dirpage = vmp_paddr_to_page(V2P(pte));
+	case kPageUsePML3: {
+		/*
+		 * a table is only trimmable once it has no nonswap PTEs (all
+		 * are swap), so nothing but its directory PTE refers to it.
+		 */
+		vm_page_t *dirpage = vmp_paddr_to_page(
+		    (V2P(pte) / PGSIZE) * PGSIZE);
+
+		vmp_page_lock(page);
+		kassert(vmp_page_cold(page)->nonswap_ptes == 0);
+		kassert(vmp_page_refcnt(page) == 1);
+		/*
+		 * nothing tracks writes to a table's PTEs, so it is written to
+		 * the pagefile again before it can be stolen.
+		 */
+		page->dirty = true;
+		page->standby_priority = trim_priority(ps, page);
+		vmp_page_cold(page)->reused = false;
 		vmp_md_transition_table_pointers(ps, dirpage, page);
-		kfatal("Implement pagetable eviction!\n");
+		vmp_page_release_locked(page);
+		vmp_page_unlock(page);
+		vmp_stat_adjust(vmp_page_node(page), ntable_evicted, 1);
+		return;
 	}
 
 	default:
 		kfatal("Implement me\n");
 	}
+}
+
+/*!
+ * Evict a large page: it is split into small pages under a new table, and all
+ * of those are evicted. Trimming is how memory pressure is relieved, so this is
+ * where large pages are given up under pressure.
+ */
+static void
+wsl_evict_large(eprocess_t *ps, pte_t *pte)
+{
+	vm_page_t *page = vmp_pte_hw_page(pte, VMP_LARGE_PAGE_LEVEL);
+	vm_page_t *table = vmp_md_split_large_pte(ps, pte);
+	pte_t *ptes = (pte_t *)P2V(vmp_page_paddr(table));
 
-	vmp_page_release_locked(page);
+	for (size_t i = 0; i < VMP_LARGE_PAGE_PAGES; i++)
+		wsl_evict(ps, &page[i], &ptes[i]);
 }
 
 static struct vmp_wsle *
@@ -62,23 +131,32 @@ wsl_trim_1(eprocess_t *ps)
 	pte_t *pte;
 	int r;
 	vm_page_t *page;
+	ipl_t ipl;
 
+	ipl = ke_spinlock_acquire(&ps->wsl_lock);
 	wsle = TAILQ_FIRST(&ps->wsl.queue);
-	if (wsle == NULL)
+	if (wsle == NULL) {
+		ke_spinlock_release(&ps->wsl_lock, ipl);
 		return NULL;
+	}
 
 	TAILQ_REMOVE(&ps->wsl.queue, wsle, queue_entry);
 	RB_REMOVE(vmp_wsle_rb, &ps->wsl.tree, wsle);
+	ps->wsl.nentries -= wsle_weight(wsle);
+	ke_spinlock_release(&ps->wsl_lock, ipl);
 
 	kprintf("Evicting 0x%zx\n", (size_t)wsle->vaddr);
-	ps->wsl.nentries--;
 
-	if (!wsle->is_pagetable) {
+	if (wsle->is_large) {
+		vmp_fetch_pte_level(ps, wsle->vaddr, VMP_LARGE_PAGE_LEVEL, &pte);
+		wsl_evict_large(ps, pte);
+		return wsle;
+	} else if (!wsle->is_pagetable) {
 		vmp_fetch_pte(ps, wsle->vaddr, &pte);
 		page = vmp_pte_hw_page(pte, 1);
 	} else {
 		page = vmp_paddr_to_page(V2P(wsle->vaddr));
-		pte = (pte_t *)P2V(page->referent_pte);
+		pte = (pte_t *)P2V(vmp_page_cold(page)->referent_pte);
 	}
 
 	wsl_evict(ps, page, pte);
@@ -89,9 +167,8 @@ wsl_trim_1(eprocess_t *ps)
 /*! true if it could expand, false otherwise */
 static bool
 wsl_try_expand(eprocess_t *ps) LOCK_REQUIRES(ps->ws_lock)
-    LOCK_REQUIRES(vmp_pfn_lock)
 {
-	if (vmstat.nfree + vmstat.nstandby > vmparam.min_avail_for_expansion) {
+	if (vmp_avail_pages() > vmparam.min_avail_for_expansion) {
 		ps->wsl.max += vmparam.ws_page_expansion_count;
 		return true;
 	}
@@ -99,72 +176,137 @@ wsl_try_expand(eprocess_t *ps) LOCK_REQUIRES(ps->ws_lock)
 		return false;
 }
 
-void
-vmp_wsl_insert(eprocess_t *ps, vaddr_t vaddr, bool is_pagetable, bool locked)
+static int
+wsl_insert(eprocess_t *ps, vaddr_t vaddr, bool is_pagetable, bool is_large,
+    bool locked) LOCK_REQUIRES(ps->ws_lock)
 {
+	size_t weight = is_large ? VMP_LARGE_PAGE_PAGES : 1;
 	struct vmp_wsle *wsle = NULL;
+	ipl_t ipl;
 
-	kassert(vmp_wsl_find(ps, vaddr) == NULL);
 	kassert(ps->wsl.nentries <= ps->wsl.max);
 
-	if (ps->wsl.nentries == ps->wsl.max && wsl_try_expand(ps) == false) {
-		wsle = wsl_trim_1(ps);
-		kassert(wsle != NULL);
+	/* only the WS lock holder adds entries, so this can't change */
+	while (ps->wsl.nentries + weight > ps->wsl.max) {
+		struct vmp_wsle *trimmed;
+
+		if (wsl_try_expand(ps))
+			continue;
+
+		trimmed = wsl_trim_1(ps);
+		if (trimmed == NULL) {
+			if (wsle != NULL)
+				kmem_free(wsle, sizeof(*wsle));
+			return -1;
+		}
+
+		if (wsle == NULL)
+			wsle = trimmed;
+		else
+			kmem_free(trimmed, sizeof(*trimmed));
 	}
 
 	if (wsle == NULL)
 		wsle = kmem_alloc(sizeof(*wsle));
 
-	ps->wsl.nentries++;
+	ipl = ke_spinlock_acquire(&ps->wsl_lock);
+	kassert(vmp_wsl_find(ps, vaddr) == NULL);
+
+	ps->wsl.nentries += weight;
 	if (locked)
 		ps->wsl.nlocked++;
 
 	wsle->vaddr = vaddr;
 	wsle->is_pagetable = is_pagetable;
+	wsle->is_large = is_large;
+	wsle->heat = 0;
 
 	if (!locked)
 		TAILQ_INSERT_TAIL(&ps->wsl.queue, wsle, queue_entry);
 
 	RB_INSERT(vmp_wsle_rb, &ps->wsl.tree, wsle);
+	ke_spinlock_release(&ps->wsl_lock, ipl);
+
+	return 0;
+}
+
+void
+vmp_wsl_insert(eprocess_t *ps, vaddr_t vaddr, bool is_pagetable, bool locked)
+{
+	int r = wsl_insert(ps, vaddr, is_pagetable, false, locked);
+	kassert(r == 0);
+}
+
+int
+vmp_wsl_insert_large(eprocess_t *ps, vaddr_t vaddr)
+{
+	return wsl_insert(ps, vaddr, false, true, false);
 }
 
 void
 vmp_wsl_remove(eprocess_t *ps, vaddr_t vaddr)
 {
-	struct vmp_wsle *wsle = vmp_wsl_find(ps, vaddr);
+	struct vmp_wsle *wsle;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&ps->wsl_lock);
+	wsle = vmp_wsl_find(ps, vaddr);
 	kassert(wsle != NULL);
 	RB_REMOVE(vmp_wsle_rb, &ps->wsl.tree, wsle);
 	TAILQ_REMOVE(&ps->wsl.queue, wsle, queue_entry);
+	ke_spinlock_release(&ps->wsl_lock, ipl);
 	kmem_free(wsle, sizeof(*wsle));
 }
 
+void
+vmp_wsl_rename(eprocess_t *ps, vaddr_t vaddr, vaddr_t new_vaddr)
+{
+	struct vmp_wsle *wsle;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&ps->wsl_lock);
+	wsle = vmp_wsl_find(ps, vaddr);
+	kassert(wsle != NULL);
+	RB_REMOVE(vmp_wsle_rb, &ps->wsl.tree, wsle);
+	wsle->vaddr = new_vaddr;
+	RB_INSERT(vmp_wsle_rb, &ps->wsl.tree, wsle);
+	ke_spinlock_release(&ps->wsl_lock, ipl);
+}
+
 void
 vmp_wsl_lock_entry(eprocess_t *ps, vaddr_t vaddr)
 {
-	struct vmp_wsle *wsle = vmp_wsl_find(ps, vaddr);
+	struct vmp_wsle *wsle;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&ps->wsl_lock);
+	wsle = vmp_wsl_find(ps, vaddr);
 	kassert(wsle != NULL);
 	TAILQ_REMOVE(&ps->wsl.queue, wsle, queue_entry);
 	ps->wsl.nlocked++;
+	ke_spinlock_release(&ps->wsl_lock, ipl);
 }
 
 void
 vmp_wsl_unlock_entry(eprocess_t *ps, vaddr_t vaddr)
 {
-	struct vmp_wsle *wsle = vmp_wsl_find(ps, vaddr);
+	struct vmp_wsle *wsle;
+	ipl_t ipl;
+
+	ipl = ke_spinlock_acquire(&ps->wsl_lock);
+	wsle = vmp_wsl_find(ps, vaddr);
 	kassert(wsle != NULL);
 	TAILQ_INSERT_TAIL(&ps->wsl.queue, wsle, queue_entry);
 	ps->wsl.nlocked--;
+	ke_spinlock_release(&ps->wsl_lock, ipl);
 }
 
 int
 vmp_wsl_trim_n(eprocess_t *ps, size_t count) LOCK_REQUIRES(ps->ws_lock)
-    LOCK_EXCLUDES(vmp_pfn_lock)
 {
 	for (int i = 0; i < count; i++) {
 		struct vmp_wsle *wsle;
-		ipl_t ipl = vmp_acquire_pfn_lock();
 		wsle = wsl_trim_1(ps);
-		vmp_release_pfn_lock(ipl);
 		if (wsle == NULL)
 			return i;
 		kmem_free(wsle, sizeof(struct vmp_wsle));
@@ -172,6 +314,53 @@ vmp_wsl_trim_n(eprocess_t *ps, size_t count) LOCK_REQUIRES(ps->ws_lock)
 	return count;
 }
 
+void
+vmp_wsl_sample(eprocess_t *ps,
+    void (*fn)(void *arg, vaddr_t vaddr, vm_page_t *page, unsigned heat),
+    void *arg)
+{
+	struct vmp_wsle *wsle;
+
+	/* the tree only changes under the WS lock, so needn't be locked */
+	RB_FOREACH (wsle, vmp_wsle_rb, &ps->wsl.tree) {
+		pte_t *pte;
+
+		if (wsle->is_pagetable || wsle->is_large)
+			continue;
+
+		if (vmp_fetch_pte(ps, wsle->vaddr, &pte) != 0 ||
+		    vmp_pte_characterise(pte) != kPTEKindValid)
+			continue;
+
+		/* the TLB entry would be flushed here */
+		if (vmp_pte_hw_test_clear_accessed(pte)) {
+			if (wsle->heat < VMP_WSLE_HEAT_MAX)
+				wsle->heat++;
+		} else {
+			wsle->heat /= 2;
+		}
+
+		fn(arg, wsle->vaddr, vmp_pte_hw_page(pte, 1), wsle->heat);
+	}
+}
+
+int
+vmp_wsl_next(eprocess_t *ps, vaddr_t *vaddr)
+{
+	struct vmp_wsle key, *wsle;
+
+	key.vaddr = *vaddr;
+	for (wsle = RB_NFIND(vmp_wsle_rb, &ps->wsl.tree, &key); wsle != NULL;
+	     wsle = RB_NEXT(vmp_wsle_rb, &ps->wsl.tree, wsle)) {
+		if (!wsle->is_pagetable && !wsle->is_large) {
+			*vaddr = wsle->vaddr;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
 void
 vmp_wsl_dump(eprocess_t *ps)
 {
@@ -179,10 +368,12 @@ vmp_wsl_dump(eprocess_t *ps)
 	kprintf("WSL: %zu entries\n%zu locked enties:\n", ps->wsl.nentries, ps->wsl.nlocked);
 	kprintf("All entries:\n");
 	RB_FOREACH (wsle, vmp_wsle_rb, &ps->wsl.tree) {
-		kprintf("- 0x%zx\n", (size_t)wsle->vaddr);
+		kprintf("- 0x%zx%s\n", (size_t)wsle->vaddr,
+		    wsle->is_large ? " (large)" : "");
 	}
 	kprintf("Dynamic Entries:\n");
 	TAILQ_FOREACH (wsle, &ps->wsl.queue, queue_entry) {
-		kprintf("- 0x%zx\n", (size_t)wsle->vaddr);
+		kprintf("- 0x%zx%s\n", (size_t)wsle->vaddr,
+		    wsle->is_large ? " (large)" : "");
 	}
 }
@@ -0,0 +1,63 @@
+/*!
+ * @file zeroer.c
+ * @brief The zeroer clears free pages in the background, moving them from the
+ * buddy allocator to the zeroed queue so that page allocation seldom has to
+ * clear a page itself. It only keeps vmparam.zeroed_target pages zeroed on each
+ * node, so as not to break up every free block in the buddy allocator.
+ */
+
+#define _GNU_SOURCE
+
+#include <kdk/libkern.h>
+#include <kdk/nanokern.h>
+#include <sched.h>
+
+#include "vmp.h"
+
+kevent_t vmp_zeroer_event;
+
+void *
+vmp_zeroer(void *)
+{
+	struct sched_param param = { 0 };
+	struct vmp_node *node;
+	vm_page_t *page;
+	ipl_t ipl;
+
+	/* only run when there is nothing better to do */
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+loop:
+	ke_event_wait(&vmp_zeroer_event, -1);
+
+	page = NULL;
+	for (unsigned i = 0; i < vmp_nnodes && page == NULL; i++) {
+		node = &vmp_nodes[i];
+		if (vmp_stat_read(&node->stat, nzeroed) <
+		    vmparam.zeroed_target) {
+			ipl = ke_spinlock_acquire(&node->free_lock);
+			page = vmp_buddy_alloc(node, 0);
+			ke_spinlock_release(&node->free_lock, ipl);
+		}
+	}
+	if (page == NULL) {
+		ke_event_clear(&vmp_zeroer_event);
+		goto loop;
+	}
+
+	/*
+	 * The page is now out of the buddy, so no one can allocate it while it
+	 * is cleared. It stays counted in nfree meanwhile, so the availability
+	 * figures don't dip. It may be a while before it is allocated, so it is
+	 * cleared around the cache.
+	 */
+	vmp_page_zero(page, true);
+
+	ipl = ke_spinlock_acquire(&node->free_lock);
+	vmp_pgq_insert_tail(&node->zero_pgq, page);
+	ke_spinlock_release(&node->free_lock, ipl);
+	vmp_stat_adjust(node, nfree, -1);
+	vmp_stat_adjust(node, nzeroed, 1);
+
+	goto loop;
+}